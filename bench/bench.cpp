@@ -0,0 +1,287 @@
+/*
+  bench.cpp
+  
+  End to end benchmark. Simulated arduinos on pseudo terminals are put in a
+  directory of their own, the server is run on that directory in a child
+  process, and the benchmark talks to it over ZMQ like any client would. It
+  reports the lines per second that come through, the round trip for a send
+  to a device and back, and the CPU and memory the server used.
+  
+  No hardware is needed, so it can be run on any Linux box.
+  
+  $ ./zmqarduino_bench [devices] [seconds] [lines per second per device] [line length] [io threads]
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+  
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "server.hpp"
+#include "histogram.hpp"
+#include "benchutil.hpp"
+
+#include <nlohmann/json.hpp>
+#include <zmq.hpp>
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+using namespace std;
+using njson = nlohmann::json;
+
+// the other way round to the server, away from a real one.
+static const int PULL_PORT = 25558;
+static const int PUSH_PORT = 25559;
+static const int REQ_PORT = 23013;
+
+static const size_t MAX_OUTPUT = 65536;
+
+struct Device : BenchDevice {
+  string id;
+  string input;       // from the server, not a whole line yet
+  string output;      // to the server, not written yet
+  bool identified;    // like most sketches, only stream once asked for the ID
+  long dropped;       // lines that didn't fit
+};
+
+static void flush(Device *dev) {
+  
+  while (!dev->output.empty()) {
+    ssize_t n = write(dev->master, dev->output.data(), dev->output.size());
+    if (n <= 0) {
+      return;
+    }
+    dev->output.erase(0, n);
+  }
+  
+}
+
+static void reply(Device *dev, const string &line) {
+  
+  if (line == "ID") {
+    dev->output += dev->id + "\n";
+    dev->identified = true;
+  }
+  else if (line.compare(0, 5, "PING ") == 0) {
+    dev->output += "PONG " + line.substr(5) + "\n";
+  }
+  
+}
+
+static void simulate(vector<Device> *devs, int rate, int length, atomic<bool> *running) {
+  
+  vector<struct pollfd> fds(devs->size());
+  for (size_t i=0; i<devs->size(); i++) {
+    fds[i].fd = (*devs)[i].master;
+  }
+  
+  // every device sends the same numbered lines.
+  auto start = chrono::steady_clock::now();
+  long sent = 0;
+  char buf[1024];
+  while (*running) {
+    for (size_t i=0; i<fds.size(); i++) {
+      fds[i].events = POLLIN | ((*devs)[i].output.empty() ? 0 : POLLOUT);
+    }
+    poll(fds.data(), fds.size(), 1);
+  
+    for (size_t i=0; i<fds.size(); i++) {
+      Device *dev = &(*devs)[i];
+      if (fds[i].revents & POLLIN) {
+        ssize_t n = read(dev->master, buf, sizeof(buf));
+        if (n > 0) {
+          dev->input.append(buf, n);
+          size_t nl;
+          while ((nl = dev->input.find('\n')) != string::npos) {
+            reply(dev, dev->input.substr(0, nl));
+            dev->input.erase(0, nl + 1);
+          }
+        }
+      }
+    }
+  
+    long due = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() * rate / 1000000;
+    for (; sent < due; sent++) {
+      string num = to_string(sent);
+      string line = num + string(length > (int)num.length() ? length - num.length() : 0, 'x') + "\n";
+      for (auto &dev: *devs) {
+        if (!dev.identified) {
+          continue;
+        }
+        if (dev.output.size() + line.length() > MAX_OUTPUT) {
+          dev.dropped++;
+          continue;
+        }
+        dev.output += line;
+      }
+    }
+  
+    for (auto &dev: *devs) {
+      flush(&dev);
+    }
+  }
+  
+}
+
+int main(int argc, char *argv[]) {
+  
+  int devices = argc > 1 ? atoi(argv[1]) : 8;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  int rate = argc > 3 ? atoi(argv[3]) : 100;
+  int length = argc > 4 ? atoi(argv[4]) : 32;
+  int iothreads = argc > 5 ? atoi(argv[5]) : -1;
+  
+  char dir[] = "/tmp/zmqarduino_bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    cerr << "couldn't make " << dir << endl;
+    return 1;
+  }
+  
+  // each pseudo terminal looks like a USB serial device in the directory.
+  vector<Device> devs(devices);
+  for (int i=0; i<devices; i++) {
+    Device *dev = &devs[i];
+    if (!opendevice(dev, string(dir) + "/ttyUSB" + to_string(i))) {
+      return 1;
+    }
+    dev->id = "bench" + to_string(i);
+    dev->identified = false;
+    dev->dropped = 0;
+  }
+  
+  auto forked = chrono::steady_clock::now();
+  ServerOptions options;
+  options.devdir = dir;
+  options.iothreads = iothreads;
+  options.latencylog = 0;
+  pid_t pid = runserver(options, PULL_PORT, PUSH_PORT, REQ_PORT);
+  
+  zmq::context_t context(1);
+  zmq::socket_t push(context, ZMQ_PUSH);
+  push.bind("tcp://127.0.0.1:" + to_string(PULL_PORT));
+  zmq::socket_t pull(context, ZMQ_PULL);
+  pull.bind("tcp://127.0.0.1:" + to_string(PUSH_PORT));
+  
+  atomic<bool> running(true);
+  thread sim(simulate, &devs, rate, length, &running);
+  
+  long lines = 0;
+  int ids = 0;
+  Histogram rtt;
+  map<long, chrono::steady_clock::time_point> pings;
+  long pingseq = 0;
+  bool measuring = false;
+  
+  // everything coming back, a batch of received or not.
+  auto handle = [&](const njson &doc) {
+    if (doc.contains("id")) {
+      ids++;
+      return;
+    }
+    if (!doc.contains("received")) {
+      return;
+    }
+    const njson &r = doc["received"];
+    vector<njson> entries;
+    if (r.is_array()) {
+      entries.assign(r.begin(), r.end());
+    }
+    else {
+      entries.push_back(r);
+    }
+    for (auto &e: entries) {
+      string data = e.value("data", "");
+      if (data.compare(0, 5, "PONG ") == 0) {
+        auto p = pings.find(atol(data.c_str() + 5));
+        if (p != pings.end()) {
+          rtt.record(chrono::steady_clock::now() - p->second);
+          pings.erase(p);
+        }
+      }
+      else if (measuring) {
+        lines++;
+      }
+    }
+  };
+  
+  zmq::pollitem_t items[] = { { pull, 0, ZMQ_POLLIN, 0 } };
+  auto receive = [&](long ms) {
+    zmq::poll(items, 1, chrono::milliseconds(ms));
+    zmq::message_t msg;
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+    while (pull.recv(&msg, ZMQ_DONTWAIT)) {
+#else
+    while (pull.recv(msg, zmq::recv_flags::dontwait)) {
+#endif
+      handle(njson::parse(string((const char *)msg.data(), msg.size())));
+    }
+  };
+  
+  // all the devices have to be up before it's fair to count.
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+  while (ids < devices && chrono::steady_clock::now() < deadline) {
+    receive(100);
+  }
+  long startup = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - forked).count();
+  if (ids < devices) {
+    cerr << "only " << ids << " of " << devices << " devices came up" << endl;
+  }
+  
+  // send to each device in turn 10 times a second while the lines come in.
+  measuring = true;
+  auto begin = chrono::steady_clock::now();
+  auto end = begin + chrono::seconds(seconds);
+  auto nextping = begin;
+  while (chrono::steady_clock::now() < end) {
+    auto now = chrono::steady_clock::now();
+    if (now >= nextping) {
+      const Device &dev = devs[pingseq % devices];
+      njson msg;
+      msg["send"]["device"] = dev.path;
+      msg["send"]["data"] = "PING " + to_string(pingseq);
+      pings[pingseq++] = now;
+      send(&push, msg.dump());
+      nextping += chrono::milliseconds(100);
+    }
+    receive(max(0L, (long)chrono::duration_cast<chrono::milliseconds>(nextping - chrono::steady_clock::now()).count()));
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  measuring = false;
+  
+  running = false;
+  sim.join();
+  struct rusage u;
+  stopserver(pid, &u);
+  double lifetime = chrono::duration<double>(chrono::steady_clock::now() - forked).count();
+  double cpu = u.ru_utime.tv_sec + u.ru_utime.tv_usec / 1e6 + u.ru_stime.tv_sec + u.ru_stime.tv_usec / 1e6;
+  
+  long dropped = 0;
+  for (auto &dev: devs) {
+    dropped += dev.dropped;
+    closedevice(&dev);
+  }
+  rmdir(dir);
+  
+  cout << devices << " devices, " << rate << " lines/s each of " << length << " chars, "
+    << iothreads << " io threads, " << seconds << "s" << endl;
+  cout << setw(16) << left << "startup" << startup << "ms" << endl;
+  cout << setw(16) << "lines/s" << (long)(lines / elapsed) << " (sent " << (long)devices * rate
+    << ", " << dropped << " didn't fit in the device)" << endl;
+  cout << setw(16) << "round trip";
+  rtt.describe(cout);
+  cout << ", " << pings.size() << " lost" << endl;
+  cout << setw(16) << "server cpu" << fixed << setprecision(1) << cpu * 100 / lifetime << "% of a core" << endl;
+  cout << setw(16) << "server max rss" << u.ru_maxrss << "kB" << endl;
+  return 0;
+  
+}
+  
\ No newline at end of file
@@ -0,0 +1,121 @@
+/*
+  benchutil.cpp
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "benchutil.hpp"
+
+#include "server.hpp"
+
+#include <boost/log/trivial.hpp>
+#include <boost/log/expressions.hpp>
+#include <iostream>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+using namespace std;
+
+static Server *server = 0;
+
+static void stop(int) {
+  if (server) {
+    server->stop();
+  }
+}
+
+bool opendevice(BenchDevice *dev, const string &path) {
+
+  char name[256];
+  if (openpty(&dev->master, &dev->slave, name, 0, 0) < 0) {
+    cerr << "openpty failed for " << path << endl;
+    return false;
+  }
+  struct termios t;
+  tcgetattr(dev->slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(dev->slave, TCSANOW, &t);
+  fcntl(dev->master, F_SETFL, fcntl(dev->master, F_GETFL) | O_NONBLOCK);
+  dev->path = path;
+  unlink(path.c_str());
+  if (symlink(name, path.c_str()) < 0) {
+    cerr << "couldn't link " << path << endl;
+    close(dev->master);
+    close(dev->slave);
+    return false;
+  }
+  return true;
+
+}
+
+void closedevice(BenchDevice *dev) {
+
+  unlink(dev->path.c_str());
+  close(dev->master);
+  close(dev->slave);
+
+}
+
+static void serve(const ServerOptions &options, int pullport, int pushport, int reqport) {
+
+  boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+  // the other way round to the client.
+  zmq::context_t context(1);
+  zmq::socket_t pull(context, ZMQ_PULL);
+  pull.connect("tcp://127.0.0.1:" + to_string(pullport));
+  zmq::socket_t push(context, ZMQ_PUSH);
+  push.connect("tcp://127.0.0.1:" + to_string(pushport));
+
+  Server s(&pull, &push, reqport, options);
+  server = &s;
+  signal(SIGTERM, stop);
+  s.start();
+  server = 0;
+
+}
+
+pid_t runserver(const ServerOptions &options, int pullport, int pushport, int reqport) {
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    serve(options, pullport, pushport, reqport);
+    _exit(0);
+  }
+  return pid;
+
+}
+
+void stopserver(pid_t pid, struct rusage *usage) {
+
+  kill(pid, SIGTERM);
+  int status;
+  struct rusage u;
+  wait4(pid, &status, 0, usage ? usage : &u);
+
+}
+
+void send(zmq::socket_t *push, const string &s) {
+
+  zmq::message_t msg(s.length());
+  memcpy(msg.data(), s.c_str(), s.length());
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+  push->send(msg);
+#else
+  push->send(msg, zmq::send_flags::none);
+#endif
+
+}
@@ -0,0 +1,48 @@
+/*
+  benchutil.hpp
+
+  What the end to end benchmarks share: simulated devices on pseudo
+  terminals, the server run on them in a child process and sending to it
+  over ZMQ.
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_benchutil
+#define H_benchutil
+
+#include <string>
+#include <zmq.hpp>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+struct ServerOptions;
+
+// a pseudo terminal that looks like a USB serial device at path. The
+// benchmark is the device on the master side, which doesn't block.
+struct BenchDevice {
+  int master;
+  int slave;
+  std::string path;
+};
+
+// false if it couldn't be made, after saying why.
+bool opendevice(BenchDevice *dev, const std::string &path);
+
+// removes the link and closes it.
+void closedevice(BenchDevice *dev);
+
+// the server, quiet apart from warnings, connected to a client that binds
+// pullport and pushport.
+pid_t runserver(const ServerOptions &options, int pullport, int pushport, int reqport);
+
+// stops it and waits for it, with what it used if usage isn't 0.
+void stopserver(pid_t pid, struct rusage *usage = 0);
+
+void send(zmq::socket_t *push, const std::string &s);
+
+#endif // H_benchutil
@@ -0,0 +1,262 @@
+/*
+  creditbench.cpp
+
+  Sends lines to a simulated arduino with a tiny serial buffer, once without
+  credit and once with, and reports how many arrive whole. The arduino is a
+  pseudo terminal that only holds [rx buffer] bytes and reads them out at
+  [bytes per second] like a sketch that is busy doing other things. What
+  doesn't fit is lost, like it is on an AVR. With credit it acks what it
+  reads each time round its loop.
+
+  The service is run in a child process like zmqarduino_bench, and the
+  acks must never get to the client.
+
+  $ ./zmqarduino_creditbench [lines] [line length] [rx buffer] [bytes per second]
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "server.hpp"
+#include "benchutil.hpp"
+
+#include <nlohmann/json.hpp>
+#include <zmq.hpp>
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+
+using namespace std;
+using njson = nlohmann::json;
+
+// the other way round to the server, away from a real one.
+static const int PULL_PORT = 25568;
+static const int PUSH_PORT = 25569;
+static const int REQ_PORT = 23023;
+
+struct Device : BenchDevice {
+  string rx;          // the serial buffer
+  string line;        // read out of it, not a whole line yet
+  bool credit;        // ack what is read
+  atomic<long> good;  // lines that arrived whole
+  atomic<long> bad;   // lines that didn't
+  long overrun;       // bytes that didn't fit in rx
+};
+
+struct Result {
+  long good;
+  long bad;
+  long overrun;
+  long leaked;        // acks that got to the client
+  double seconds;
+};
+
+static void reply(Device *dev, const string &s) {
+
+  // the device only writes a little, the pty always has room.
+  if (write(dev->master, s.data(), s.size()) < 0) {
+    cerr << "device write failed" << endl;
+  }
+
+}
+
+static void readline(Device *dev, const string &line) {
+
+  if (line == "ID") {
+    reply(dev, "credit\n");
+    return;
+  }
+
+  // the line is only good if it's exactly what was sent.
+  if (line.compare(0, 5, "LINE ") == 0) {
+    string num = to_string(atol(line.c_str() + 5));
+    size_t length = line.length();
+    if (line == "LINE " + num + string(length > num.length() + 5 ? length - num.length() - 5 : 0, 'x')) {
+      dev->good++;
+      return;
+    }
+  }
+  dev->bad++;
+
+}
+
+static void simulate(Device *dev, int rxsize, int rate, atomic<bool> *running) {
+
+  struct pollfd fd = { dev->master, POLLIN, 0 };
+  auto start = chrono::steady_clock::now();
+  long taken = 0;
+  char buf[1024];
+  while (*running) {
+    poll(&fd, 1, 1);
+
+    // the UART fills the buffer as fast as it's sent.
+    ssize_t n;
+    while ((n = read(dev->master, buf, sizeof(buf))) > 0) {
+      size_t room = rxsize - dev->rx.size();
+      dev->rx.append(buf, min((size_t)n, room));
+      if ((size_t)n > room) {
+        dev->overrun += n - room;
+      }
+    }
+
+    // and the sketch gets round to reading it when it can.
+    long due = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() * rate / 1000000;
+    size_t len = min((size_t)(due - taken), dev->rx.size());
+    if (len == 0) {
+      if (dev->rx.empty()) {
+        // it would have been reading if there was anything.
+        taken = due;
+      }
+      continue;
+    }
+    taken += len;
+    for (size_t i=0; i<len; i++) {
+      char c = dev->rx[i];
+      if (c == '\n') {
+        readline(dev, dev->line);
+        dev->line.clear();
+      }
+      else {
+        dev->line += c;
+      }
+    }
+    dev->rx.erase(0, len);
+    if (dev->credit) {
+      reply(dev, string(1, '\x06') + to_string(len) + "\n");
+    }
+  }
+
+}
+
+static Result run(int lines, int length, int rxsize, int rate, bool credit) {
+
+  Result result = { 0, 0, 0, 0, 0 };
+
+  char dir[] = "/tmp/zmqarduino_creditbench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    cerr << "couldn't make " << dir << endl;
+    return result;
+  }
+
+  Device dev;
+  string path = string(dir) + "/ttyUSB0";
+  if (!opendevice(&dev, path)) {
+    return result;
+  }
+  dev.credit = credit;
+  dev.good = 0;
+  dev.bad = 0;
+  dev.overrun = 0;
+
+  // every line is sent, however long it has to wait.
+  ServerOptions options;
+  options.devdir = dir;
+  options.latencylog = 0;
+  options.writepolicy = "block";
+  options.credit = credit ? rxsize : 0;
+  pid_t pid = runserver(options, PULL_PORT, PUSH_PORT, REQ_PORT);
+
+  zmq::context_t context(1);
+  zmq::socket_t push(context, ZMQ_PUSH);
+  push.bind("tcp://127.0.0.1:" + to_string(PULL_PORT));
+  zmq::socket_t pull(context, ZMQ_PULL);
+  pull.bind("tcp://127.0.0.1:" + to_string(PUSH_PORT));
+
+  atomic<bool> running(true);
+  thread sim(simulate, &dev, rxsize, rate, &running);
+
+  bool identified = false;
+  zmq::pollitem_t items[] = { { pull, 0, ZMQ_POLLIN, 0 } };
+  auto receive = [&](long ms) {
+    zmq::poll(items, 1, chrono::milliseconds(ms));
+    zmq::message_t msg;
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+    while (pull.recv(&msg, ZMQ_DONTWAIT)) {
+#else
+    while (pull.recv(msg, zmq::recv_flags::dontwait)) {
+#endif
+      string s((const char *)msg.data(), msg.size());
+      njson doc = njson::parse(s);
+      if (doc.contains("id")) {
+        identified = true;
+      }
+      // the JSON escapes it.
+      if (s.find("\\u0006") != string::npos) {
+        result.leaked++;
+      }
+    }
+  };
+
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+  while (!identified && chrono::steady_clock::now() < deadline) {
+    receive(100);
+  }
+  if (!identified) {
+    cerr << "the device didn't come up" << endl;
+  }
+
+  // send everything at once, the service has to hold it back.
+  auto begin = chrono::steady_clock::now();
+  for (int i=0; i<lines; i++) {
+    string num = to_string(i);
+    njson msg;
+    msg["send"]["device"] = path;
+    msg["send"]["data"] = "LINE " + num + string(length > (int)num.length() + 5 ? length - num.length() - 5 : 0, 'x');
+    send(&push, msg.dump());
+  }
+
+  // until everything has arrived or nothing more is going to.
+  long seen = 0;
+  auto progress = chrono::steady_clock::now();
+  while (dev.good + dev.bad < lines && chrono::steady_clock::now() - progress < chrono::seconds(2)) {
+    receive(10);
+    if (dev.good + dev.bad != seen) {
+      seen = dev.good + dev.bad;
+      progress = chrono::steady_clock::now();
+    }
+  }
+  result.seconds = chrono::duration<double>(progress - begin).count();
+
+  running = false;
+  sim.join();
+  stopserver(pid);
+
+  result.good = dev.good;
+  result.bad = dev.bad;
+  result.overrun = dev.overrun;
+  closedevice(&dev);
+  rmdir(dir);
+  return result;
+
+}
+
+static void report(const string &name, const Result &r, int lines, int length) {
+
+  cout << setw(16) << left << name << r.good << " of " << lines << " whole, " << r.bad << " broken, "
+    << r.overrun << " bytes overrun, " << r.leaked << " acks leaked, "
+    << fixed << setprecision(0) << (r.good * (length + 1)) / max(r.seconds, 0.001) << " bytes/s" << endl;
+
+}
+
+int main(int argc, char *argv[]) {
+
+  int lines = argc > 1 ? atoi(argv[1]) : 500;
+  int length = argc > 2 ? atoi(argv[2]) : 48;
+  int rxsize = argc > 3 ? atoi(argv[3]) : 64;
+  int rate = argc > 4 ? atoi(argv[4]) : 10000;
+
+  cout << lines << " lines of " << length << " chars, " << rxsize << " byte buffer read at "
+    << rate << " bytes/s" << endl;
+  report("no credit", run(lines, length, rxsize, rate, false), lines, length);
+  report("credit", run(lines, length, rxsize, rate, true), lines, length);
+  return 0;
+
+}
@@ -0,0 +1,423 @@
+/*
+  microbench.cpp
+  
+  Microbenchmarks for the hot paths, reporting the time and the number of 
+  heap allocations (operator new) for each operation: building outbound 
+  messages, buffering serial data, queueing writes and JSON. The read queue
+  is timed on its own next to the vector it replaced, and then the serial
+  ones open a real port on a pseudo terminal.
+  
+  $ ./zmqarduino_microbench [filter]
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "msgpool.hpp"
+#include "BufferedAsyncSerial.h"
+#include "RingBuffer.h"
+
+#include <nlohmann/json.hpp>
+#include <boost/json.hpp>
+#include <zmq.hpp>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <new>
+#include <unistd.h>
+#include <termios.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+using namespace std;
+using njson = nlohmann::json;
+
+static atomic<long> allocations(0);
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+static string filter;
+
+// run fn enough times to get a stable number and report per operation.
+static void bench(const string &name, const function<void ()> &fn) {
+
+  if (!filter.empty() && name.find(filter) == string::npos) {
+    return;
+  }
+  
+  for (int i=0; i<1000; i++) {
+    fn();
+  }
+  
+  long iterations = 1000;
+  while (1) {
+    long before = allocations;
+    auto start = chrono::steady_clock::now();
+    for (long i=0; i<iterations; i++) {
+      fn();
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    long allocs = allocations - before;
+    if (ns > 200000000 || iterations > 100000000) {
+      cout << left << setw(44) << name << right 
+        << setw(10) << fixed << setprecision(1) << (double)ns / iterations << " ns/op"
+        << setw(8) << setprecision(2) << (double)allocs / iterations << " allocs/op" << endl;
+      return;
+    }
+    iterations *= 4;
+  }
+  
+}
+
+static const string device = "/dev/ttyUSB0";
+static const string line = "23.5,19.2,1013.25,OK";
+
+static void outbound() {
+
+  // the way sendjson used to work.
+  bench("received: json dump + copy", []() {
+    njson data;
+    data["device"] = device;
+    data["data"] = line;
+    njson msg;
+    msg["received"] = data;
+    string s = msg.dump();
+    zmq::message_t zmsg(s.length());
+    memcpy(zmsg.data(), s.c_str(), s.length());
+  });
+  
+  // serialized into a pooled buffer and handed over without a copy.
+  msgPoolPtr pool(new MsgPool());
+  bench("received: json into pooled buffer", [&pool]() {
+    njson data;
+    data["device"] = device;
+    data["data"] = line;
+    njson msg;
+    msg["received"] = data;
+    MsgBuf *buf = pool->get();
+    buf->stream() << msg;
+    zmq::message_t zmsg = pool->message(buf);
+  });
+  
+  // written straight into the pooled buffer.
+  bench("received: direct into pooled buffer", [&pool]() {
+    MsgBuf *buf = pool->get();
+    buf->append("{\"received\":{\"device\":\"");
+    buf->appendescaped(device);
+    buf->append("\",\"data\":\"");
+    buf->appendescaped(line);
+    buf->append("\"}}");
+    zmq::message_t zmsg = pool->message(buf);
+  });
+  
+  // with the device part rendered once per connection.
+  string prefix = "{\"received\":{\"device\":\"" + device + "\",\"data\":\"";
+  bench("received: per connection template", [&pool, &prefix]() {
+    MsgBuf *buf = pool->get();
+    buf->append(prefix);
+    buf->appendescaped(line);
+    buf->append("\"}}");
+    zmq::message_t zmsg = pool->message(buf);
+  });
+  
+}
+
+// a pseudo terminal with a real port opened on it, the device is the master.
+struct Pty {
+  
+  Pty() {
+    char name[256];
+    if (openpty(&master, &slave, name, 0, 0) < 0) {
+      cerr << "openpty failed" << endl;
+      exit(1);
+    }
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+    serial.open(name, 115200);
+  }
+  ~Pty() {
+    serial.close();
+    close(master);
+    close(slave);
+  }
+  
+  // what the device sends.
+  void send(const string &s) {
+    if (write(master, s.data(), s.size()) != (ssize_t)s.size()) {
+      cerr << "device write failed" << endl;
+    }
+  }
+  
+  // until the port has read as much as the device sent.
+  void arrive(uint64_t received) {
+    while (serial.received() < received) {
+      this_thread::yield();
+    }
+  }
+  
+  // what the device was sent.
+  void take(size_t size) {
+    char buf[4096];
+    while (size > 0) {
+      ssize_t n = read(master, buf, min(size, sizeof(buf)));
+      if (n <= 0) {
+        cerr << "device read failed" << endl;
+        return;
+      }
+      size -= n;
+    }
+  }
+  
+  int master;
+  int slave;
+  BufferedAsyncSerial serial;
+  
+};
+
+static void serial() {
+
+  // a line arriving from the device, through readCallback, and then 
+  // readLineUntil or readStringUntil taking a line. The backlog is whole 
+  // lines already waiting in front. This is the real port on a pty so the 
+  // time includes the kernel and waking the port's thread.
+  for (int len : { 16, 64, 256 }) {
+    for (int backlog : { 0, 4096, 65536 }) {
+      Pty pty;
+      string data = string(len - 1, 'x') + "\n";
+      for (int i=0; i<backlog / len; i++) {
+        pty.send(data);
+      }
+      uint64_t received = (backlog / len) * len;
+      pty.arrive(received);
+      string st;
+      string name = "serial: " + to_string(len) + " chars " + to_string(backlog) + " behind";
+      bench(name + ", readLineUntil", [&]() {
+        pty.send(data);
+        received += data.size();
+        pty.arrive(received);
+        pty.serial.readLineUntil(st);
+      });
+      bench(name + ", readStringUntil", [&]() {
+        pty.send(data);
+        received += data.size();
+        pty.arrive(received);
+        string result = pty.serial.readStringUntil();
+      });
+    }
+  }
+  
+}
+
+// the read queue as it was before the ring buffer, to compare with.
+struct VectorQueue {
+
+  void append(const char *data, size_t len) {
+    queue.insert(queue.end(), data, data + len);
+  }
+  
+  vector<char>::iterator find(const string &s) {
+    if (s.size() == 0) {
+      return queue.end();
+    }
+    vector<char>::iterator it = queue.begin();
+    for (;;) {
+      vector<char>::iterator result = std::find(it, queue.end(), s[0]);
+      if (result == queue.end()) {
+        return queue.end();
+      }
+      size_t i = 1;
+      while (i < s.size() && result + i != queue.end() && result[i] == s[i]) {
+        i++;
+      }
+      if (i == s.size()) {
+        return result;
+      }
+      if (result + i == queue.end()) {
+        return queue.end();
+      }
+      it = result + 1;
+    }
+  }
+  
+  bool readUntil(const string &delim, string &line) {
+    vector<char>::iterator it = find(delim);
+    if (it == queue.end()) {
+      return false;
+    }
+    line.assign(queue.begin(), it);
+    queue.erase(queue.begin(), it + delim.size());
+    return true;
+  }
+  
+  vector<char> queue;
+  
+};
+
+static void buffer() {
+
+  // the read queue on its own: a line appended the way readCallback does
+  // it and then taken with readUntil, behind a backlog of whole lines. No
+  // port, so this is only the buffer.
+  for (int len : { 16, 64, 256 }) {
+    for (int backlog : { 0, 4096, 65536 }) {
+      string data = string(len - 1, 'x') + "\n";
+      RingBuffer ring(backlog + len);
+      VectorQueue vec;
+      for (int i=0; i<backlog / len; i++) {
+        ring.append(data.data(), data.size());
+        vec.append(data.data(), data.size());
+      }
+      string st;
+      string name = "buffer: " + to_string(len) + " chars " + to_string(backlog) + " behind";
+      bench(name + ", ring", [&]() {
+        ring.append(data.data(), data.size());
+        ring.readUntil("\n", st);
+      });
+      bench(name + ", vector", [&]() {
+        vec.append(data.data(), data.size());
+        vec.readUntil("\n", st);
+      });
+    }
+  }
+  
+  // a long line arriving a few chars at a time. The ring only scans the
+  // new chars, the vector starts again from the front.
+  const char chunk[] = "xxxxxxxx";
+  RingBuffer ring(65536);
+  bench("buffer: find in a growing partial line, ring", [&]() {
+    ring.append(chunk, sizeof(chunk) - 1);
+    if (ring.find("\n") == RingBuffer::npos && ring.full()) {
+      ring.clear();
+    }
+  });
+  VectorQueue vec;
+  bench("buffer: find in a growing partial line, vector", [&]() {
+    vec.append(chunk, sizeof(chunk) - 1);
+    if (vec.find("\n") == vec.queue.end() && vec.queue.size() >= 65536) {
+      vec.queue.clear();
+    }
+  });
+  
+}
+
+static void queue() {
+
+  // a send going through the port to the device when the port isn't busy,
+  // with the delimiter added to the string first and with writeLine 
+  // putting it straight in the queue.
+  Pty pty;
+  string data = "FLASH";
+  bench("write: writeString", [&]() {
+    pty.serial.writeString(data + "\n");
+    pty.take(data.size() + 1);
+  });
+  bench("write: writeLine", [&]() {
+    pty.serial.writeLine(data);
+    pty.take(data.size() + 1);
+  });
+  
+  // a burst, which nextWrite coalesces into a few writes.
+  bench("write: 100 writeLines in a burst", [&]() {
+    for (int i=0; i<100; i++) {
+      pty.serial.writeLine(data);
+    }
+    pty.take((data.size() + 1) * 100);
+  });
+  
+}
+
+static void json() {
+
+  // the messages the server pulls, with nlohmann (received is above).
+  string send = "{\"send\":{\"device\":\"/dev/ttyUSB0\",\"data\":\"FLASH\"}}";
+  bench("json: nlohmann parse send", [&]() {
+    njson doc = njson::parse(send);
+  });
+  
+  // and the ones a client gets, with boost::json and nlohmann.
+  string received = "{\"received\":{\"device\":\"" + device + "\",\"data\":\"" + line + "\"}}";
+  bench("json: boost::json parse received", [&]() {
+    boost::json::value doc = boost::json::parse(received);
+  });
+  bench("json: nlohmann parse received", [&]() {
+    njson doc = njson::parse(received);
+  });
+  
+  // the stream client's messages, with boost::json and nlohmann.
+  bench("json: boost::json serialize addobject", []() {
+    boost::json::value j = { 
+      { "type", "addobject" }, 
+      { "objtype", "idea" },
+      { "me", "user" },
+      { "stream", "stream" },
+      { "text", line },
+      { "sequence", "1" }
+    };
+    string s = boost::json::serialize(j);
+  });
+  bench("json: nlohmann dump addobject", []() {
+    njson j = { 
+      { "type", "addobject" }, 
+      { "objtype", "idea" },
+      { "me", "user" },
+      { "stream", "stream" },
+      { "text", line },
+      { "sequence", "1" }
+    };
+    string s = j.dump();
+  });
+  string ack = "{\"type\":\"ack\",\"corr\":1234}";
+  bench("json: boost::json parse ack", [&]() {
+    boost::json::value doc = boost::json::parse(ack);
+  });
+  bench("json: nlohmann parse ack", [&]() {
+    njson doc = njson::parse(ack);
+  });
+  
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc > 1) {
+    filter = argv[1];
+  }
+  
+  cout << "allocations are operator new only, libzmq's own mallocs aren't counted." << endl;
+  outbound();
+  buffer();
+  serial();
+  queue();
+  json();
+  return 0;
+  
+}
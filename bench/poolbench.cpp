@@ -0,0 +1,196 @@
+/*
+  poolbench.cpp
+  
+  Compare a thread per serial port against a shared io pool, using pseudo
+  terminals as simulated arduinos. Each configuration runs in its own process
+  so that the thread, memory and context switch numbers don't leak between them.
+  
+  $ ./zmqarduino_poolbench [seconds] [lines per second per port] [pool threads]
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "BufferedAsyncSerial.h"
+#include "wakeup.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+using namespace std;
+
+struct Result {
+  long lines;
+  long threads;
+  long rsskb;
+  long ctxswitches;
+};
+
+static long procstatus(const string &name) {
+
+  ifstream f("/proc/self/status");
+  string line;
+  while (getline(f, line)) {
+    if (line.compare(0, name.length(), name) == 0) {
+      return atol(line.c_str() + name.length());
+    }
+  }
+  return -1;
+  
+}
+
+static long ctxswitches() {
+
+  struct rusage u;
+  getrusage(RUSAGE_SELF, &u);
+  return u.ru_nvcsw + u.ru_nivcsw;
+  
+}
+
+static Result run(int ports, int poolthreads, int seconds, int rate) {
+
+  vector<int> masters;
+  vector<int> slaves;
+  vector<BufferedAsyncSerial *> serials;
+  shared_ptr<SerialIoPool> pool;
+  if (poolthreads >= 0) {
+    pool.reset(new SerialIoPool(poolthreads));
+  }
+  Wakeup wakeup;
+  
+  for (int i=0; i<ports; i++) {
+    int master, slave;
+    char name[256];
+    if (openpty(&master, &slave, name, 0, 0) < 0) {
+      cerr << "openpty failed after " << i << " ports" << endl;
+      exit(1);
+    }
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+    masters.push_back(master);
+    slaves.push_back(slave);
+    BufferedAsyncSerial *serial;
+    if (pool) {
+      serial = new BufferedAsyncSerial(pool.get());
+      serial->open(name, 115200);
+    }
+    else {
+      serial = new BufferedAsyncSerial(name, 115200);
+    }
+    serial->setLineCallback(std::bind(&Wakeup::signal, &wakeup));
+    serials.push_back(serial);
+  }
+  
+  atomic<bool> running(true);
+  
+  // the simulated arduinos all stream lines at the same rate.
+  thread writer([&]() {
+    auto next = chrono::steady_clock::now();
+    auto period = chrono::microseconds(1000000 / rate);
+    const char line[] = "0123456789012345678901234567890\n";
+    while (running) {
+      for (auto m : masters) {
+        ssize_t n = write(m, line, sizeof(line) - 1);
+        (void)n;
+      }
+      next += period;
+      this_thread::sleep_until(next);
+    }
+  });
+  
+  long start = ctxswitches();
+  long lines = 0;
+  auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+  while (chrono::steady_clock::now() < end) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(wakeup.fd(), &fds);
+    struct timeval tv = { 0, 100000 };
+    select(wakeup.fd() + 1, &fds, 0, 0, &tv);
+    wakeup.drain();
+    for (auto s : serials) {
+      while (s->readStringUntil("\n").length() > 0) {
+        lines++;
+      }
+    }
+  }
+  
+  Result r;
+  r.lines = lines;
+  r.ctxswitches = ctxswitches() - start;
+  r.threads = procstatus("Threads:");
+  r.rsskb = procstatus("VmRSS:");
+  
+  running = false;
+  writer.join();
+  for (auto s : serials) {
+    s->close();
+    delete s;
+  }
+  for (auto m : masters) {
+    close(m);
+  }
+  for (auto s : slaves) {
+    close(s);
+  }
+  return r;
+  
+}
+
+int main(int argc, char *argv[]) {
+
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  int rate = argc > 2 ? atoi(argv[2]) : 100;
+  int poolthreads = argc > 3 ? atoi(argv[3]) : 0;
+  
+  cout << "ports  mode       threads  rss(kB)  ctxsw/s  lines/s" << endl;
+  for (int ports : { 8, 32, 128 }) {
+    for (int mode : { -1, poolthreads }) {
+      // a pipe back from the child so each run gets a fresh process.
+      int fds[2];
+      if (pipe(fds) < 0) {
+        return 1;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        Result r = run(ports, mode, seconds, rate);
+        ssize_t n = write(fds[1], &r, sizeof(r));
+        _exit(n == sizeof(r) ? 0 : 1);
+      }
+      close(fds[1]);
+      Result r;
+      bool ok = read(fds[0], &r, sizeof(r)) == sizeof(r);
+      close(fds[0]);
+      waitpid(pid, 0, 0);
+      if (!ok) {
+        cerr << "run failed" << endl;
+        return 1;
+      }
+      cout << setw(5) << ports << "  " << setw(9) << left << (mode < 0 ? "per-port" : "shared") << right
+        << setw(8) << r.threads << setw(9) << r.rsskb 
+        << setw(9) << r.ctxswitches / seconds << setw(9) << r.lines / seconds << endl;
+    }
+  }
+  return 0;
+  
+}
@@ -0,0 +1,291 @@
+/*
+  replay.cpp
+  
+  Plays a capture made with "--capture" back to a server. Each device in the
+  capture becomes a pseudo terminal in a directory of its own, and what the
+  device sent is sent again when it was sent. What the server wrote to the
+  device is waited for and checked, so a slow server pushes the rest of the
+  capture back rather than getting ahead of it. The ZMQ messages the server
+  was sent are sent again, with the device paths changed to the new ones.
+  
+  Run the server on the directory it prints:
+  
+  $ ./zmqarduino_replay capture [speed] [dir] [pull port] [push port]
+  $ ./ZMQArduino --devDir dir
+  
+  A speed of 2 plays it twice as fast, and 0 as fast as it will go.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "capture.hpp"
+#include "benchutil.hpp"
+
+#include <zmq.hpp>
+#include <boost/optional.hpp>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <functional>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock::time_point timepoint;
+
+// a device in the capture, played on the pseudo terminal at path.
+struct Device : BenchDevice {
+  string captured;      // the path in the capture
+  string expected;      // written by the server in the capture, not seen yet
+  string written;       // written by the server now, not checked yet
+  uint64_t matched;     // chars the same in both
+  long mismatch;        // where they first weren't, -1 for never
+};
+
+// the server should have written to a device by now.
+static const auto SYNC_TIMEOUT = chrono::seconds(5);
+
+// how long to wait for the server to be started.
+static const auto START_TIMEOUT = chrono::seconds(120);
+
+static vector<Device> devs;
+static long received = 0;
+
+static void check(Device *dev) {
+
+  size_t n = min(dev->expected.size(), dev->written.size());
+  if (dev->mismatch < 0) {
+    for (size_t i=0; i<n; i++) {
+      if (dev->expected[i] != dev->written[i]) {
+        dev->mismatch = dev->matched + i;
+        cerr << dev->captured << " differs at " << dev->mismatch << endl;
+        break;
+      }
+    }
+  }
+  dev->expected.erase(0, n);
+  dev->written.erase(0, n);
+  dev->matched += n;
+
+}
+
+// read what the server writes to the devices and sends on ZMQ until done
+// or the time is up.
+static void pump(zmq::socket_t *pull, timepoint until, const function<bool ()> &done) {
+
+  vector<zmq::pollitem_t> items(devs.size() + 1);
+  items[0] = { *pull, 0, ZMQ_POLLIN, 0 };
+  for (size_t i=0; i<devs.size(); i++) {
+    items[i + 1] = { 0, devs[i].master, ZMQ_POLLIN, 0 };
+  }
+
+  char buf[4096];
+  while (!done()) {
+    auto now = chrono::steady_clock::now();
+    if (now >= until) {
+      return;
+    }
+    zmq::poll(items.data(), items.size(), chrono::duration_cast<chrono::milliseconds>(until - now) + chrono::milliseconds(1));
+
+    zmq::message_t msg;
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+    while (pull->recv(&msg, ZMQ_DONTWAIT)) {
+#else
+    while (pull->recv(msg, zmq::recv_flags::dontwait)) {
+#endif
+      received++;
+    }
+
+    for (size_t i=0; i<devs.size(); i++) {
+      if (items[i + 1].revents & ZMQ_POLLIN) {
+        ssize_t n;
+        while ((n = read(devs[i].master, buf, sizeof(buf))) > 0) {
+          devs[i].written.append(buf, n);
+        }
+        check(&devs[i]);
+      }
+    }
+  }
+
+}
+
+static void writeall(Device *dev, string_view data, zmq::socket_t *pull) {
+
+  // the server might be behind reading, so keep reading what it writes
+  // while waiting for room.
+  while (!data.empty()) {
+    ssize_t n = write(dev->master, data.data(), data.size());
+    if (n > 0) {
+      data.remove_prefix(n);
+    }
+    else {
+      pump(pull, chrono::steady_clock::now() + chrono::milliseconds(1), []() { return false; });
+    }
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 2) {
+    cerr << "usage: " << argv[0] << " capture [speed] [dir] [pull port] [push port]" << endl;
+    return 1;
+  }
+  double speed = argc > 2 ? atof(argv[2]) : 1;
+  string dir = argc > 3 ? argv[3] : "";
+  int pullport = argc > 4 ? atoi(argv[4]) : 5558;
+  int pushport = argc > 5 ? atoi(argv[5]) : 5559;
+
+  CaptureReader reader(argv[1]);
+  vector<CaptureReader::Record> records;
+  CaptureReader::Record r;
+  map<string, size_t> paths;
+  while (reader.next(&r)) {
+    records.push_back(r);
+    if ((r.kind == Capture::SERIALIN || r.kind == Capture::SERIALOUT) && paths.find(string(r.path)) == paths.end()) {
+      size_t i = paths.size();
+      paths[string(r.path)] = i;
+    }
+  }
+  if (records.empty()) {
+    cerr << argv[1] << " is empty" << endl;
+    return 1;
+  }
+
+  if (dir.empty()) {
+    char tmp[] = "/tmp/zmqarduino_replay.XXXXXX";
+    if (!mkdtemp(tmp)) {
+      cerr << "couldn't make " << tmp << endl;
+      return 1;
+    }
+    dir = tmp;
+  }
+
+  // each device is a pseudo terminal with the same name as it had.
+  devs.resize(paths.size());
+  for (auto &p: paths) {
+    Device *dev = &devs[p.second];
+    if (!opendevice(dev, dir + "/" + p.first.substr(p.first.rfind('/') + 1))) {
+      return 1;
+    }
+    dev->captured = p.first;
+    dev->matched = 0;
+    dev->mismatch = -1;
+  }
+
+  zmq::context_t context(1);
+  zmq::socket_t push(context, ZMQ_PUSH);
+  push.bind("tcp://127.0.0.1:" + to_string(pullport));
+  zmq::socket_t pull(context, ZMQ_PULL);
+  pull.bind("tcp://127.0.0.1:" + to_string(pushport));
+
+  cout << records.size() << " records, " << devs.size() << " devices in " << dir << endl;
+  cout << "run: ZMQArduino --devDir " << dir << " --pullPort " << pullport << " --pushPort " << pushport << endl;
+
+  // the clock starts when the server first sends or writes something, which
+  // is lined up with the first thing it sent or wrote in the capture.
+  boost::optional<uint64_t> first;
+  for (auto &r: records) {
+    if (r.kind == Capture::SERIALOUT || r.kind == Capture::ZMQOUT) {
+      first = r.ns;
+      break;
+    }
+  }
+  pump(&pull, chrono::steady_clock::now() + (first ? START_TIMEOUT : chrono::seconds(0)), []() {
+    if (received > 0) {
+      return true;
+    }
+    for (auto &dev: devs) {
+      if (dev.matched > 0 || !dev.written.empty()) {
+        return true;
+      }
+    }
+    return false;
+  });
+  
+  // everything is played at the time it was captured from there, unless
+  // waiting for the server pushes it all back.
+  auto start = chrono::steady_clock::now() - chrono::nanoseconds((int64_t)(speed > 0 && first ? *first / speed : 0));
+  chrono::nanoseconds behind(0);
+  long sent = 0, expected = 0, timeouts = 0;
+  for (auto &r: records) {
+    auto due = speed > 0 ? start + behind + chrono::nanoseconds((int64_t)(r.ns / speed)) : chrono::steady_clock::now();
+    switch (r.kind) {
+
+    case Capture::SERIALIN:
+      pump(&pull, due, []() { return false; });
+      writeall(&devs[paths[string(r.path)]], r.data, &pull);
+      break;
+
+    case Capture::SERIALOUT:
+      {
+        Device *dev = &devs[paths[string(r.path)]];
+        dev->expected.append(r.data);
+        check(dev);
+        pump(&pull, chrono::steady_clock::now() + SYNC_TIMEOUT, [dev]() {
+          return dev->expected.empty();
+        });
+        if (!dev->expected.empty()) {
+          cerr << dev->captured << " timed out waiting for " << dev->expected.size() << " chars" << endl;
+          timeouts++;
+          dev->expected.clear();
+        }
+        auto now = chrono::steady_clock::now();
+        if (speed > 0 && now > due) {
+          behind += now - due;
+        }
+      }
+      break;
+
+    case Capture::ZMQIN:
+      {
+        pump(&pull, due, []() { return false; });
+        // backwards so /dev/ttyUSB10 is done before /dev/ttyUSB1.
+        string s(r.data);
+        for (auto p = paths.rbegin(); p != paths.rend(); p++) {
+          const Device &dev = devs[p->second];
+          for (size_t pos = 0; (pos = s.find(dev.captured, pos)) != string::npos; pos += dev.path.size()) {
+            s.replace(pos, dev.captured.size(), dev.path);
+          }
+        }
+        send(&push, s);
+        sent++;
+      }
+      break;
+
+    case Capture::ZMQOUT:
+      expected++;
+      break;
+
+    }
+  }
+
+  // let the last of it come through.
+  pump(&pull, chrono::steady_clock::now() + chrono::seconds(1), []() { return false; });
+
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  double captured = records.back().ns / 1e9;
+  cout << "played " << captured << "s of capture in " << elapsed << "s" << endl;
+  cout << "sent " << sent << " ZMQ messages, received " << received << " (" << expected << " in the capture)" << endl;
+  int mismatches = 0;
+  for (auto &dev: devs) {
+    if (dev.mismatch >= 0) {
+      mismatches++;
+    }
+    closedevice(&dev);
+  }
+  cout << mismatches << " devices written differently, " << timeouts << " waits timed out" << endl;
+  if (argc <= 3) {
+    rmdir(dir.c_str());
+  }
+  return mismatches || timeouts ? 2 : 0;
+
+}
@@ -13,6 +13,8 @@
 #include <vector>
 #include <memory>
 #include <functional>
+#include <chrono>
+#include <cstdint>
 #include <boost/asio.hpp>
 #include <boost/utility.hpp>
 #include <boost/thread.hpp>
@@ -22,6 +24,43 @@
  */
 class AsyncSerialImpl;
 
+/**
+ * A pool of worker threads running a single io_service, which can be shared
+ * by many serial ports instead of each port running a thread of its own.
+ * Operations on each port are serialized through a strand, so the ordering
+ * of reads and writes on a port is the same as with a dedicated thread.
+ */
+class SerialIoPool: private boost::noncopyable
+{
+public:
+    /**
+     * Constructor. Starts the worker threads.
+     * \param threads number of worker threads, 0 for one per core
+     */
+    explicit SerialIoPool(size_t threads=0);
+
+    /**
+     * Destructor. Stops the io_service and joins the worker threads.
+     * All the serial ports using the pool must be closed first.
+     */
+    ~SerialIoPool();
+
+    /**
+     * \return the shared io_service
+     */
+    boost::asio::io_service& service();
+
+    /**
+     * \return the number of worker threads
+     */
+    size_t size() const;
+
+private:
+    boost::asio::io_service io;
+    boost::asio::executor_work_guard<boost::asio::io_service::executor_type> work;
+    boost::thread_group threads;
+};
+
 /**
  * Asyncronous serial class.
  * Intended to be a base class.
@@ -31,6 +70,13 @@ class AsyncSerial: private boost::noncopyable
 public:
     AsyncSerial();
 
+    /**
+     * Constructor. The serial device will run on a shared pool of threads
+     * rather than a thread of its own. Use open() to open the device.
+     * \param pool the pool to use, must outlive this object
+     */
+    explicit AsyncSerial(SerialIoPool *pool);
+
     /**
      * Constructor. Creates and opens a serial device.
      * \param devname serial device name, example "/dev/ttyS0" or "COM1"
@@ -99,22 +145,118 @@ public:
      * Write data asynchronously. Returns immediately.
      * \param data array of char to be sent through the serial device
      * \param size array size
+     * \return false if it would go over the write limit, nothing is written
      */
-    void write(const char *data, size_t size);
+    bool write(const char *data, size_t size);
 
      /**
      * Write data asynchronously. Returns immediately.
      * \param data to be sent through the serial device
+     * \return false if it would go over the write limit, nothing is written
      */
-    void write(const std::vector<char>& data);
+    bool write(const std::vector<char>& data);
 
     /**
     * Write a string asynchronously. Returns immediately.
     * Can be used to send ASCII data to the serial device.
     * To send binary data, use write()
     * \param s string to send
+    * \return false if it would go over the write limit, nothing is written
     */
-    void writeString(const std::string& s);
+    bool writeString(const std::string& s);
+
+    /**
+     * Write a string and a delimiter asynchronously. Returns immediately.
+     * The same as writeString(s+delim) without making a new string.
+     * A write with a priority goes before any less important writes that
+     * haven't started, and if they can be dropped to make room for it they
+     * are dropped first.
+     * \param s string to send
+     * \param delim delimiter to send after it, default='\n'
+     * \param priority higher goes first, default 0
+     * \return false if it would go over the write limit, nothing is written
+     */
+    bool writeLine(const std::string& s, char delim='\n', int priority=0);
+
+    /**
+     * \return the number of chars waiting to be written, including any
+     * being written now
+     */
+    size_t writePending() const;
+
+    /**
+     * \return the number of writes waiting to be written, including any
+     * being written now
+     */
+    size_t writesPending() const;
+
+    /**
+     * \return the number of writes dropped to make room for newer ones
+     */
+    uint64_t writesDropped() const;
+
+    /**
+     * Limit what can be waiting to be written. A write that would go over
+     * is refused, or the oldest writes that haven't started are dropped to
+     * make room for it. A write on its own is never refused.
+     * \param chars most chars waiting, 0 for no limit
+     * \param writes most writes waiting, 0 for no limit
+     * \param dropOldest drop old writes rather than refuse new ones
+     */
+    void setWriteLimit(size_t chars, size_t writes, bool dropOldest);
+
+    /**
+     * Only write as much as the device has said it has room for. Writes
+     * go out in chunks of no more than the credit left, and wait when it
+     * runs out until addCredit() is called. Writes that haven't started
+     * are still whole, so they can be dropped. Changing the window keeps
+     * what has already been written and not acknowledged.
+     * \param chars most chars written and not yet acknowledged, 0 for
+     * no limit
+     */
+    void setCreditWindow(size_t chars);
+
+    /**
+     * Give back credit when the device says it has read chars, never
+     * more than the window
+     * \param chars the number of chars read
+     */
+    void addCredit(size_t chars);
+
+    /**
+     * \return the chars that can be written before the device has to
+     * acknowledge more, or 0 if there is no window
+     */
+    size_t credit() const;
+
+    /**
+     * Set a callback that is called when everything that was waiting has
+     * been written. It is called from the thread that runs write operations,
+     * so it must be cheap and thread safe.
+     * \param callback the drained callback
+     */
+    void setDrainedCallback(const std::function<void ()>& callback);
+
+    /**
+     * Set a callback that is called when the data from each write has been
+     * written to the port, with how long it waited since it was queued and
+     * its priority. The callback is called from the thread that runs write
+     * operations, so it must be cheap and thread safe.
+     * \param callback the write callback
+     */
+    void setWriteCallback(
+            const std::function<void (std::chrono::steady_clock::duration, int)>& callback);
+
+    /**
+     * Set a callback that is given a copy of everything read from and
+     * written to the port, with true for written data. Writes are given
+     * when they are queued, reads before the read callback. Must be set
+     * before open() since it is called from the thread that runs read
+     * operations without a lock.
+     * \param callback the capture callback
+     */
+    void setCaptureCallback(
+            const std::function<void (bool, const char*, size_t)>& callback);
 
     virtual ~AsyncSerial()=0;
 
@@ -122,6 +264,13 @@ public:
      * Read buffer maximum size
      */
     static const int readBufferSize=512;
+
+    /**
+     * Most chars in one write when writes are coalesced, so that a write
+     * with a priority doesn't wait for all of them. A write bigger than
+     * this still goes in one.
+     */
+    static const int writeCoalesceSize=256;
 private:
 
     /**
@@ -137,9 +286,26 @@ private:
     void readEnd(const boost::system::error_code& error,
         size_t bytes_transferred);
 
+    /**
+     * Queue data to be written, and post a doWrite if there isn't one
+     * on its way already.
+     * \param delim a char to write after the data, or 0 for none
+     * \param priority goes before less important writes that haven't started
+     * \return false if there wasn't room
+     */
+    bool queueWrite(const char *data, size_t size, const char *delim,
+            int priority=0);
+
+    /**
+     * Start writing whatever is queued that there is credit for, on the
+     * strand with no write in progress.
+     * \return true if a write was started
+     */
+    bool startWrite();
+
     /**
      * Callback called to start an asynchronous write operation.
-     * If it is already in progress, does nothing.
+     * Only posted when no write is in progress.
      * This callback is called by the io_service in the spawned thread.
      */
     void doWrite();
@@ -156,6 +322,18 @@ private:
      */
     void doClose();
 
+    /**
+     * Note that an operation has been posted or started on the io_service,
+     * so that close() can wait for it when running on a shared pool.
+     */
+    void startOp();
+
+    /**
+     * Note that an operation has finished. Must be the last thing a
+     * callback does.
+     */
+    void endOp();
+
     std::shared_ptr<AsyncSerialImpl> pimpl;
 
 protected:
@@ -178,6 +356,34 @@ protected:
      */
     void clearReadCallback();
 
+    /**
+     * Stop reading once the read in progress has been given to the read
+     * callback, until resumeReading() is called. Can be called from the
+     * read callback.
+     */
+    void pauseReading();
+
+    /**
+     * Start reading again after pauseReading()
+     */
+    void resumeReading();
+
+    /**
+     * Write a flow control char such as XON or XOFF. It goes before
+     * anything queued that hasn't started, and isn't counted as a write,
+     * limited, dropped or held back for credit.
+     * \param c the char to write
+     */
+    void writeFlowControl(char c);
+
+    /**
+     * Raise or drop the RTS line, for hardware flow control that the
+     * driver doesn't do itself.
+     * \param on true to raise it
+     * \return false if the device doesn't have one
+     */
+    bool setRTS(bool on);
+
 };
 
 /**
@@ -8,8 +8,12 @@
  */
 
 #include "AsyncSerial.h"
+#include "RingBuffer.h"
 //#include <mutex>
 #include <boost/thread.hpp>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 
 #ifndef BUFFEREDASYNCSERIAL_H
 #define	BUFFEREDASYNCSERIAL_H
@@ -17,8 +21,20 @@
 class BufferedAsyncSerial: public AsyncSerial
 {
 public:
+    /**
+     * How the device is told to stop sending while reading is paused
+     */
+    enum FlowSignal { none, software, hardware };
+
     BufferedAsyncSerial();
 
+    /**
+     * Constructor. The serial device will run on a shared pool of threads
+     * rather than a thread of its own. Use open() to open the device.
+     * \param pool the pool to use, must outlive this object
+     */
+    explicit BufferedAsyncSerial(SerialIoPool *pool);
+
     /**
     * Opens a serial device.
     * \param devname serial device name, example "/dev/ttyS0" or "COM1"
@@ -77,13 +93,101 @@ public:
      */
     std::string readStringUntil(const std::string delim="\n");
 
+    /**
+     * Read a line asynchronously. Returns immediately. Unlike
+     * readStringUntil() an empty line can be told apart from no line.
+     * \param line the received line, without the delimiter
+     * \param delim line delimiter, default='\n'
+     * \return true if a whole line was read
+     */
+    bool readLineUntil(std::string& line, const std::string& delim="\n");
+
+    /**
+     * Read a binary frame that starts with its length as two bytes, low
+     * byte first. Returns immediately.
+     * \param frame the received frame, without the length
+     * \return true if a whole frame was read
+     */
+    bool readPrefixedFrame(std::string& frame);
+
+    /**
+     * \return the number of chars received and not yet read
+     */
+    size_t available();
+
+    /**
+     * \return the number of chars received since the device was opened
+     */
+    uint64_t received() const;
+
+    /**
+     * \return when the last char taken by a read arrived
+     */
+    std::chrono::steady_clock::time_point lastArrival();
+
     virtual ~BufferedAsyncSerial();
 
     /**
     * Clear the Buffer
     */
     void clear();
-    
+
+    /**
+     * Set a callback that is called when a line delimiter arrives, so that
+     * the reader can wait for whole lines instead of polling. The callback is
+     * called from the thread that runs read operations, so it must be cheap
+     * and thread safe.
+     * \param callback the line callback
+     * \param delim line delimiter, default='\n'
+     */
+    void setLineCallback(const std::function<void ()>& callback,
+            char delim='\n');
+
+    /**
+     * Like setLineCallback(), but the callback is called whenever any data
+     * arrives. For binary data that has no delimiter.
+     * \param callback the data callback
+     */
+    void setDataCallback(const std::function<void ()>& callback);
+
+    /**
+     * Limit what can be received and not yet read. Once high chars are
+     * waiting reading stops until they are read down to low, so no more
+     * than high plus one read are ever buffered. The read queue is made
+     * big enough for that here, and with no limit reading stops when it's
+     * too full for another read. The device can be told
+     * to stop sending too, with XOFF/XON or by dropping RTS. The line or
+     * data callback is called when reading stops, so a reader that can't
+     * find a whole line can throw away what's there.
+     * \param high most chars waiting before reading stops, 0 for no limit
+     * \param low chars waiting when it starts again
+     * \param signal how to tell the device, default none
+     */
+    void setReadLimit(size_t high, size_t low, FlowSignal signal=none);
+
+    /**
+     * \return true if reading has stopped because the limit was reached
+     */
+    bool readingPaused();
+
+    /**
+     * Start reading again if it stopped with less than the limit waiting,
+     * for when what's waiting can't be read until more arrives, such as
+     * the start of a long line.
+     * \return false if the limit has been reached, so it never can be
+     */
+    bool unblockReading();
+
+    /**
+     * \return the number of times reading stopped because of the limit
+     */
+    uint64_t overflows() const;
+
+    /**
+     * Chars the read queue holds until setReadLimit() asks for more
+     */
+    static const size_t readQueueSize=65536;
+
 private:
 
     /**
@@ -92,17 +196,43 @@ private:
     void readCallback(const char *data, size_t len);
 
     /**
-     * Finds a substring in a vector of char. Used to look for the delimiter.
-     * \param v vector where to find the string
-     * \param s string to find
-     * \return the beginning of the place in the vector where the first
-     * occurrence of the string is, or v.end() if the string was not found
+     * Update lastArrivalTime after a read, call with readQueueMutex locked
+     */
+    void takeArrival();
+
+    /**
+     * Start reading again if it was paused and enough has been read, call
+     * with readQueueMutex locked
+     */
+    void checkResume();
+
+    /**
+     * Start reading again and tell the device, call with readQueueMutex
+     * locked
+     */
+    void restartReading();
+
+    /**
+     * \return the chars waiting when reading stops, call with
+     * readQueueMutex locked
      */
-    static std::vector<char>::iterator findStringInVector(std::vector<char>& v,
-            const std::string& s);
+    size_t highMark() const;
 
-    std::vector<char> readQueue;
+    RingBuffer readQueue;
     boost::mutex readQueueMutex;
+    std::function<void ()> lineCallback; ///< Protected by readQueueMutex
+    char lineDelim;
+    bool anyData; ///< Call lineCallback for any data, not just lineDelim
+    std::atomic<uint64_t> receivedCount; ///< Read without the mutex
+    /// Where each chunk received ends in receivedCount, and when it arrived
+    std::deque<std::pair<uint64_t,std::chrono::steady_clock::time_point> >
+            arrivals;
+    std::chrono::steady_clock::time_point lastArrivalTime;
+    size_t readHigh; ///< Stop reading with this many chars waiting, 0 for never
+    size_t readLow; ///< Start again with this many
+    FlowSignal flowSignal;
+    bool readPaused; ///< Protected by readQueueMutex
+    std::atomic<uint64_t> overflowCount; ///< Read without the mutex
 };
 
 #endif //BUFFEREDASYNCSERIAL_H
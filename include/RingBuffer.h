@@ -0,0 +1,127 @@
+/*
+  RingBuffer.h
+
+  Receive buffer for BufferedAsyncSerial, split out of it.
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef RINGBUFFER_H
+#define	RINGBUFFER_H
+
+#include <vector>
+#include <string>
+
+/**
+ * A ring buffer of chars that can be searched for a delimiter. Each search
+ * carries on from where the last one stopped, and taking data off the front
+ * only costs the size of the data taken, however much is queued behind it.
+ * The capacity is fixed when it's made, so the owner decides what to do
+ * with data that doesn't fit. Not thread safe.
+ */
+class RingBuffer
+{
+public:
+    /**
+     * Constructor.
+     * \param capacity capacity, rounded up to a power of 2
+     */
+    explicit RingBuffer(size_t capacity=4096);
+
+    /**
+     * Append data at the back of the buffer, as much of it as fits.
+     * \param data array of char to append
+     * \param len array size
+     * \return number of chars actually appended 0<=return<=len
+     */
+    size_t append(const char *data, size_t len);
+
+    /**
+     * Take data off the front of the buffer.
+     * \param data array where to store the data
+     * \param size array size
+     * \return number of chars actually taken 0<=return<=size
+     */
+    size_t read(char *data, size_t size);
+
+    /**
+     * Take a line off the front of the buffer.
+     * \param delim line delimiter
+     * \param line the line, without the delimiter
+     * \return true if a whole line was taken, false if the delimiter has not
+     * arrived yet, in which case line is unchanged
+     */
+    bool readUntil(const std::string& delim, std::string& line);
+
+    /**
+     * Find a delimiter. Searching again for the same delimiter starts from
+     * where the last search stopped.
+     * \param delim delimiter to find
+     * \return the offset of the delimiter from the front, or npos
+     */
+    size_t find(const std::string& delim);
+
+    /**
+     * Remove data from the front of the buffer.
+     * \param len number of chars to remove, must be <= size()
+     */
+    void consume(size_t len);
+
+    /**
+     * Copy data from the front of the buffer without removing it.
+     * \param data array where to store the data
+     * \param len number of chars to copy, must be <= size()
+     */
+    void peek(char *data, size_t len) const;
+
+    /**
+     * \return the number of chars in the buffer
+     */
+    size_t size() const { return count; }
+
+    /**
+     * \return true if the buffer is empty
+     */
+    bool empty() const { return count==0; }
+
+    /**
+     * \return true if nothing more can be appended
+     */
+    bool full() const { return count==buf.size(); }
+
+    /**
+     * \return the number of chars that can be appended
+     */
+    size_t space() const { return buf.size()-count; }
+
+    /**
+     * \return the capacity
+     */
+    size_t capacity() const { return buf.size(); }
+
+    /**
+     * Remove everything from the buffer
+     */
+    void clear();
+
+    static const size_t npos=static_cast<size_t>(-1);
+
+private:
+
+    /**
+     * \return the char at offset i from the front
+     */
+    char at(size_t i) const { return buf[(head+i)&(buf.size()-1)]; }
+
+    std::vector<char> buf; ///< Storage, size is always a power of 2
+    size_t head; ///< Offset in buf of the front
+    size_t count; ///< Number of chars in the buffer
+    size_t scanned; ///< Chars from the front known not to start lastDelim
+    std::string lastDelim; ///< Delimiter of the last search
+};
+
+#endif //RINGBUFFER_H
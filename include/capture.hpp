@@ -0,0 +1,100 @@
+/*
+  capture.hpp
+  
+  A capture of everything that goes through the server: each chunk read from
+  or written to a serial port and each ZMQ message in or out, with when it
+  happened. It is appended to a memory mapped file so it's cheap enough to
+  leave on, and zmqarduino_replay plays it back.
+  
+  The file starts with "ZMQACAP1" and the wall clock time it was started in
+  ns, then the records one after the other, each padded to 8 bytes. A record
+  with a size of 0 is the end.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_capture
+#define H_capture
+
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+class Capture {
+
+public:
+  enum Kind { SERIALIN = 1, SERIALOUT = 2, ZMQIN = 3, ZMQOUT = 4 };
+
+  struct Header {
+    uint32_t size;      // the whole record without the padding
+    uint8_t kind;
+    uint8_t unused;
+    uint16_t pathlen;   // the path follows the header, then the data
+    uint64_t ns;        // since the capture started, never goes backwards
+  };
+
+  static const char MAGIC[8];
+
+  // throws boost::system::system_error if the file can't be made.
+  Capture(const std::string &filename);
+  ~Capture();
+
+  // any thread can record. The path is the device, empty for ZMQ.
+  void record(Kind kind, const std::string &path, const char *data, size_t len);
+
+  uint64_t size();
+
+private:
+  std::mutex _mutex;
+  int _fd;
+  char *_map;
+  uint64_t _mapstart;   // where in the file the map starts
+  size_t _maplen;
+  uint64_t _end;        // where the next record goes
+  bool _stopped;        // the file couldn't be grown, nothing more is recorded
+  std::chrono::steady_clock::time_point _start;
+
+  static const size_t WINDOW = 16 * 1024 * 1024;
+
+  // the error it stopped with, 0 if it's mapped. Logs the error.
+  int remap(size_t need);
+  void unmap();
+
+};
+
+// reads a capture back one record at a time.
+class CaptureReader {
+
+public:
+  struct Record {
+    Capture::Kind kind;
+    uint64_t ns;
+    std::string_view path;
+    std::string_view data;
+  };
+
+  // throws boost::system::system_error if the file can't be read.
+  CaptureReader(const std::string &filename);
+  ~CaptureReader();
+
+  // false at the end. What the record points to lasts as long as the reader.
+  bool next(Record *record);
+
+  // when the capture was started, ns since the epoch.
+  uint64_t started() { return _started; }
+
+private:
+  const char *_map;
+  size_t _len;
+  size_t _pos;
+  uint64_t _started;
+
+};
+
+#endif // H_capture
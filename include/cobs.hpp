@@ -0,0 +1,22 @@
+/*
+  cobs.hpp
+  
+  Consistent Overhead Byte Stuffing, so binary frames can be read from
+  serial with a 0 between each one.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_cobs
+#define H_cobs
+
+#include <string>
+
+// decode a frame (without the trailing 0), false if it isn't valid COBS.
+bool cobsdecode(const std::string &in, std::string *out);
+
+#endif // H_cobs
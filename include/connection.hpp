@@ -17,37 +17,129 @@
 #define H_connection
 
 #include <string>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <boost/optional.hpp>
 
+#include "stats.hpp"
+
 class BufferedAsyncSerial;
 class Server;
+struct ServerOptions;
+
+typedef std::chrono::steady_clock::time_point timepoint;
+
+// a reference to a connection that knows when the connection has gone.
+struct ConnectionHandle {
+  uint32_t index = 0;
+  uint32_t generation = 0;  // never valid
+  
+  bool operator==(const ConnectionHandle &other) const { 
+    return index == other.index && generation == other.generation; 
+  }
+};
 
 class Connection {
 
 public:
-  Connection(const std::string &path, BufferedAsyncSerial *serial): _path(path), _serial(serial), _waitingid(true) {}
+  Connection(const std::string &path, BufferedAsyncSerial *serial);
+  
+  // what comes from the device. Binary frames are split by a 0 after COBS 
+  // or start with a 2 byte length, low byte first.
+  enum Framing { LINES, COBS, LENGTH };
   
   void close();
   void destroy();
   bool matchid(const std::string &id);
   bool matchpath(const std::string &path);
   bool isgood();
-  void write(const std::string &data);
-  void doread(Server *server);
+  bool write(const std::string &data, int priority = 0);
+  bool doread(Server *server, int budget);
   void added(Server *server);
   void sendid(Server *server);
+  void sent(Server *server);
+  void removed(Server *server);
+  
+  // tell the client when a write queue that filled up is empty again.
+  void checkdrained(Server *server);
   void describe(std::ostream &str);
+  const boost::optional<std::string> &id() { return _id; }
+  
+  // the handshake asks the arduino for its ID once it has settled.
+  void starthandshake(const ServerOptions &options);
+  boost::optional<timepoint> handshake(const ServerOptions &options, timepoint now);
+  bool handshaking() { return _state == SETTLING || _state == PROBING; }
+  
+  // a board seen before is announced with the ID it had, and then it's 
+  // asked for it while the lines flow.
+  void assumeid(const std::string &id, const ServerOptions &options);
+  bool stale() { return _state == STALE; }
+  
+  // acks are lines, so binary frames and credit don't go together and
+  // these return false rather than mix them.
+  bool setframing(Framing framing, const std::function<void ()> &wakeup);
+  
+  // writes wait for the device to ack what it has read, 0 to stop waiting.
+  bool setcredit(size_t window);
+  
+  uint64_t bytesin();
+  uint64_t overflows();
+  size_t writequeue();
+  size_t writes();
+  size_t credit();
   
   std::string _path;
+  ConnectionHandle _handle;
   std::string _stream;
   std::string _user;
   std::string _sequence;
+  std::string _usbkey;    // in the device cache, empty if it can't be cached
+  int _baud;
+  
+  // bytes left unread after the last doread, and the most there has been.
+  size_t _backlog;
+  size_t _maxbacklog;
+  
+  ConnectionStats _stats;
+  LatencyStats _latency;
 
 private:
  
   BufferedAsyncSerial *_serial;
   boost::optional<std::string> _id;
-  bool _waitingid;
+  enum HandshakeState { SETTLING, PROBING, IDENTIFIED, NOID, VERIFYING, STALE };
+  HandshakeState _state;
+  int _probes;
+  timepoint _opened;
+  timepoint _deadline;
+  size_t _backlogwarn;
+  Framing _framing;
+  std::string _encoded;
+  size_t _creditwindow;       // 0 when the device doesn't ack
+  bool _full;                 // the write queue has been full since it was last empty
+  uint64_t _writesdropped;    // by the serial port the last time we looked
+  
+  // the messages about this connection never change, so they are rendered 
+  // once and copied out from then on.
+  std::string _devicemsg;
+  std::string _sentmsg;
+  std::string _removedmsg;
+  std::string _drainedmsg;
+  std::string _idmsg;
+  std::string _receivedprefix;  // one entry in the received message
+  std::string _rawmsg;          // goes before each binary frame
+  
+  static const size_t BACKLOG_WARN = 4096;
+  static const size_t MAX_ID = 64;
+  static const char CREDIT_ACK = '\x06';  // then the number of bytes read
+  
+  void handleline(Server *server, std::string &line);
+  bool takecredit(const std::string &line);
+  bool readframe(std::string *frame);
+  void probe(const ServerOptions &options, timepoint now, bool clear);
+  void renderid();
+  static bool isid(const std::string &line);
 };
 
 #endif // H_connection
@@ -0,0 +1,53 @@
+/*
+  devicecache.hpp
+  
+  Remembers the ID and baud rate of each USB board by its vendor, product
+  and serial number, kept in a file so it lasts between runs. A board that
+  has been seen before can be announced with its ID as soon as it's opened
+  rather than after the handshake.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_devicecache
+#define H_devicecache
+
+#include <string>
+#include <map>
+#include <boost/optional.hpp>
+
+struct CachedDevice {
+  std::string id;
+  int baud;
+};
+
+class DeviceCache {
+
+public:
+  // a file that isn't there yet is an empty cache.
+  DeviceCache(const std::string &filename);
+  
+  boost::optional<CachedDevice> get(const std::string &key);
+  void put(const std::string &key, const CachedDevice &dev);
+  void forget(const std::string &key);
+  
+  size_t size() { return _devices.size(); }
+  
+  // "vid:pid:serial" for a device node from sysfs under root. None if it isn't 
+  // USB or has no serial number to tell it from another board the same.
+  static boost::optional<std::string> usbkey(const std::string &root, const std::string &path);
+  
+private:
+  std::string _filename;
+  std::map<std::string, CachedDevice> _devices;
+  
+  void save();
+  static std::string readattr(const std::string &dir, const std::string &name);
+  
+};
+
+#endif // H_devicecache
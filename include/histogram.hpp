@@ -0,0 +1,54 @@
+/*
+  histogram.hpp
+  
+  A latency histogram in the style of HdrHistogram. Each power of 2 is split
+  into 32 buckets so any value is within about 3%, from 1ns up to about 18
+  minutes, in a fixed 9K. Any thread can record.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_histogram
+#define H_histogram
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+class Histogram {
+
+public:
+  Histogram();
+  
+  void record(std::chrono::nanoseconds d);
+  
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+  int64_t max() const { return _max.load(std::memory_order_relaxed); }
+  
+  // the value in ns that p (0 to 1) of the values are at or under.
+  int64_t percentile(double p) const;
+  
+  // p50, p99, p999 and max, in us.
+  void describe(std::ostream &str) const;
+  
+private:
+  static const int SUB_BITS = 5;
+  static const int SUB = 1 << SUB_BITS;
+  static const int MAX_BITS = 40;
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB;
+  
+  std::atomic<uint64_t> _counts[BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<int64_t> _max;
+  
+  static int bucket(uint64_t ns);
+  static int64_t value(int bucket);
+  
+};
+
+#endif // H_histogram
@@ -0,0 +1,47 @@
+/*
+  hotplug.hpp
+  
+  Watch a device directory for devices being added and removed. On Linux this
+  uses inotify, everywhere else fd() is -1 and the directory has to be scanned.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_hotplug
+#define H_hotplug
+
+#include <string>
+#include <vector>
+
+class Hotplug {
+
+public:
+  Hotplug(const std::string &dir);
+  ~Hotplug();
+  
+  // the file descriptor to poll, -1 if we can't watch the directory.
+  int fd() { return _fd; }
+  
+  enum Change { added, removed, changed };
+  struct Event {
+    Change change;
+    std::string path;
+  };
+  
+  // collect the paths that have been added, removed or had their attributes
+  // changed (udev sets the permissions after the device is created), in the
+  // order it happened. Returns false if events were lost and the directory 
+  // should be scanned again.
+  bool read(std::vector<Event> *events);
+  
+private:
+  std::string _dir;
+  int _fd;
+  
+};
+
+#endif // H_hotplug
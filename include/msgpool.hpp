@@ -0,0 +1,98 @@
+/*
+  msgpool.hpp
+  
+  A pool of buffers that outgoing messages are written straight into and
+  then handed to ZMQ without a copy. ZMQ gives them back when it's done.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_msgpool
+#define H_msgpool
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <zmq.hpp>
+
+class MsgPool;
+
+typedef std::shared_ptr<MsgPool> msgPoolPtr;
+
+class MsgBuf : public std::streambuf {
+
+public:
+  MsgBuf() : _stream(this) {}
+  
+  // write anything that goes to an ostream (like JSON) into the buffer.
+  std::ostream &stream() { return _stream; }
+  
+  void append(const char *data, size_t len) { _data.append(data, len); }
+  void append(const char *s) { _data.append(s); }
+  void append(const std::string &s) { _data.append(s); }
+  void append(char c) { _data.push_back(c); }
+  
+  // write what goes inside the quotes of a JSON string. Invalid UTF-8 
+  // becomes U+FFFD.
+  void appendescaped(const std::string &s) { escape(&_data, s.data(), s.size()); }
+  static void escape(std::string *out, const char *s, size_t len);
+  
+  // true if the string can go in JSON quotes as it is.
+  static bool plain(const char *s, size_t len);
+  
+  const char *data() const { return _data.data(); }
+  size_t size() const { return _data.size(); }
+  
+  std::string _data;
+  
+protected:
+  int overflow(int c) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+  
+private:
+  friend class MsgPool;
+  
+  std::ostream _stream;
+  msgPoolPtr _pool;   // only while the buffer is in use
+  
+  static size_t utf8len(const unsigned char *s, size_t len);
+  
+};
+
+class MsgPool : public std::enable_shared_from_this<MsgPool> {
+
+public:
+  MsgPool(size_t keep = 64);
+  ~MsgPool();
+  
+  // an empty buffer, from the pool if there is one.
+  MsgBuf *get();
+  
+  // a buffer that wasn't sent goes back to the pool.
+  void put(MsgBuf *buf);
+  
+  // the buffer becomes a message and goes back to the pool when ZMQ has
+  // sent it.
+  zmq::message_t message(MsgBuf *buf);
+  
+  // how many buffers have ever been made.
+  size_t created() { return _created; }
+  
+private:
+  std::mutex _mutex;
+  std::vector<MsgBuf *> _free;
+  size_t _keep;
+  size_t _created;
+  
+  static void release(void *data, void *hint);
+  
+};
+
+#endif // H_msgpool
@@ -0,0 +1,79 @@
+/*
+  registry.hpp
+  
+  All the connections, indexed by ID and device path. Connections live in 
+  slabs so they never move, and are referred to by handles that know when 
+  the connection they pointed to has gone.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_registry
+#define H_registry
+
+#include "connection.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+class Registry {
+
+public:
+  Registry();
+  ~Registry();
+  
+  Connection *add(const std::string &path, BufferedAsyncSerial *serial);
+  void remove(Connection *conn);
+  void clear();
+  
+  // a connection has found out its ID.
+  void identified(Connection *conn);
+  
+  Connection *get(const ConnectionHandle &handle);
+  Connection *findid(const std::string &id);
+  Connection *findpath(const std::string &path);
+  
+  // the connection that has been around the longest.
+  Connection *first();
+  
+  size_t size() { return _live.size(); }
+  std::vector<Connection *>::iterator begin() { return _live.begin(); }
+  std::vector<Connection *>::iterator end() { return _live.end(); }
+  
+private:
+
+  struct Slot {
+    alignas(Connection) unsigned char storage[sizeof(Connection)];
+    uint32_t generation;  // bumped each time the slot is freed
+    bool used;
+    uint32_t nextfree;
+    size_t live;          // index in _live
+    uint64_t added;       // when it was added, to find the first
+  };
+  
+  static const uint32_t SLAB_SIZE = 64;
+  static const uint32_t NONE = 0xffffffff;
+  
+  std::vector<std::unique_ptr<Slot[]>> _slabs;
+  uint32_t _free;
+  uint32_t _slots;
+  uint64_t _added;
+  std::vector<Connection *> _live;
+  std::unordered_map<std::string, ConnectionHandle> _byid;
+  std::unordered_map<std::string, ConnectionHandle> _bypath;
+  ConnectionHandle _first;
+  
+  Slot *slot(uint32_t index) { return &_slabs[index / SLAB_SIZE][index % SLAB_SIZE]; }
+  Connection *conn(Slot *slot) { return reinterpret_cast<Connection *>(slot->storage); }
+  Connection *lookup(std::unordered_map<std::string, ConnectionHandle> &index, const std::string &key);
+  
+};
+
+#endif // H_registry
@@ -17,37 +17,127 @@
 #define H_server
 
 #include "connection.hpp"
+#include "registry.hpp"
+#include "wakeup.hpp"
+#include "msgpool.hpp"
+#include "stats.hpp"
 
 #include <nlohmann/json.hpp>
+#include <deque>
+#include <csignal>
+#include <map>
 #include <boost/iostreams/stream.hpp>
 #include <boost/optional.hpp>
 #include <zmq.hpp>
 
 class ZMQClient;
+class SerialIoPool;
+class BufferedAsyncSerial;
+class Hotplug;
+class Capture;
+class DeviceCache;
 
 typedef std::shared_ptr<ZMQClient> zmqClientPtr;
 
+// everything that can be set from the command line.
+struct ServerOptions {
+  int cadence = 200;          // ms between device scans if not using hotplug
+  int baudrate = 9600;
+  int iothreads = -1;         // shared serial io threads, -1 for a thread per device
+  int readbudget = 32;        // most lines read from a device each time round
+  std::string devdir = "/dev";
+  bool hotplug = true;
+  int settle = 500;           // ms to let an arduino reset after opening before asking for the ID
+  int idtimeout = 500;        // ms to wait for the ID
+  int idretries = 3;          // times to ask for the ID before giving up
+  double idbackoff = 2.0;     // idtimeout is multiplied by this for each retry
+  int maxhandshakes = 16;     // most devices to open and identify at once, 0 for no limit
+  int batchlatency = 2;       // most ms a received line waits in a batch
+  int batchsize = 16384;      // bytes in a batch before it is sent
+  int streamwindow = 16;      // most objects waiting for a reply at once, 1 when batching
+  int streamtimeout = 2000;   // ms to wait for a reply before sending again
+  int streamretries = 3;      // times to send again before giving up
+  int streambatch = 1;        // most lines in one addobjects, 1 for an addobject each
+  int streamlatency = 20;     // most ms a line waits to go in an addobjects
+  int statsevery = 0;         // ms between stats sent to the client, 0 for only when asked
+  int latencylog = 60000;     // ms between logging latencies, 0 for never
+  std::string capture;        // file to capture all the traffic to, empty for none
+  std::string devicecache;    // file to remember boards in, empty for none
+  std::string sysfsroot = "/sys";
+  int writequeuebytes = 16384;  // most bytes waiting to go to a device, 0 for no limit
+  int writequeuewrites = 0;     // most sends waiting to go to a device, 0 for no limit
+  std::string writepolicy = "reject";  // when that's full: reject, dropoldest or block
+  int readqueuehigh = 65536;  // bytes from a device waiting to be read before reading stops, 0 for as many as the queue holds
+  int readqueuelow = 16384;   // bytes waiting when reading starts again
+  std::string readflow = "none";  // how the device is told to stop: none, xoff or rts
+  int credit = 0;             // bytes a device can take before it acks them, 0 for no credit
+};
+
 class Server {
 
 public:
-  Server(zmq::socket_t *pull, zmq::socket_t *push, int req, int cadence, int baudrate);
+  Server(zmq::socket_t *pull, zmq::socket_t *push, int req, const ServerOptions &options);
   ~Server();
   
   void start();
+  
+  // make start return. Safe to call from a signal handler.
+  void stop();
   void sendjson(const nlohmann::json &m);
+  MsgBuf *getbuf() { return _msgs->get(); }
+  void putbuf(MsgBuf *buf) { _msgs->put(buf); }
+  void send(MsgBuf *buf);
+  void sendframe(const std::string &header, MsgBuf *frame);
+  void send(const std::string &msg);
+  void received(const std::string &prefix, const std::string &line);
+  void identified(Connection *conn);
+  Connection *get(const ConnectionHandle &handle);
   
   zmqClientPtr _zmq;
 
 private:
   zmq::socket_t *_pull;
   zmq::socket_t *_push;
-  std::vector<Connection *> _connections;
+  msgPoolPtr _msgs;
+  std::shared_ptr<Capture> _capture;  // before the connections that use it
+  Registry _connections;
   std::vector<std::string> _curdevs;
-  int _cadence;
-  int _baudrate;
+  Wakeup _wakeup;
+  std::shared_ptr<SerialIoPool> _pool;
+  std::shared_ptr<Hotplug> _hotplug;
+  std::shared_ptr<DeviceCache> _cache;
+  ServerOptions _options;
+  std::deque<std::string> _waiting;
+  int _handshakes;                    // devices opened and still being asked for their ID
+  timepoint _burststart;
+  int _burstcount;
+  bool _started;
+  volatile sig_atomic_t _stopping;
+  
+  // received lines go out together when the client asks for batches.
+  bool _batching;
+  int _batchlatency;
+  size_t _batchsize;
+  MsgBuf *_batch;
+  timepoint _batchstart;
+  
+  ZMQStats _zmqstats;
+  int _statsevery;
+  timepoint _laststats;
+  timepoint _lastlatency;
+  timepoint _pulled;
+  
+  // with the block write policy, the send that didn't fit. Nothing more is 
+  // pulled until it does.
+  boost::optional<ConnectionHandle> _blocked;
+  std::string _blockeddata;
+  int _blockedpriority;
+  std::map<std::string, int> _connects;
   
-  void connect(const std::string &path, int baud);
-  void sendserial(Connection *conn, const std::string &data);
+  bool connect(const std::string &path, int baud);
+  void setupserial(BufferedAsyncSerial *serial);
+  void sendserial(Connection *conn, const std::string &data, int priority);
+  bool unblock();
   Connection *find(const std::string &name);
   Connection *finddevice(const std::string &device);
   
@@ -57,8 +147,20 @@ private:
   void getdevs(std::vector<std::string> *devs);
   void opendevs(const std::vector<std::string> &devs);
   void handladdremove();
+  void handlehotplug();
+  static bool isdevice(const std::string &path);
   void remove(const std::string &path);
   bool anyneedsid();
+  long handshake();
+  void reopen(const std::string &path);
+  bool iswaiting(const std::string &path);
+  void setbatch(const nlohmann::json &batch);
+  void flushbatch();
+  long batchwait();
+  void sendstats();
+  long statswait();
+  void loglatency();
+  long latencywait();
   
 };
 
@@ -0,0 +1,89 @@
+/*
+  stats.hpp
+  
+  Counters and gauges that are cheap enough to leave on all the time. They
+  are relaxed atomics, so a snapshot from another thread is close but not
+  exact.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_stats
+#define H_stats
+
+#include <atomic>
+#include <cstdint>
+
+#include "histogram.hpp"
+
+// only ever goes up.
+class Counter {
+
+public:
+  Counter(): _value(0) {}
+  
+  void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+  
+private:
+  std::atomic<uint64_t> _value;
+  
+};
+
+// the last value it was set to.
+class Gauge {
+
+public:
+  Gauge(int64_t value = 0): _value(value) {}
+  
+  void set(int64_t value) { _value.store(value, std::memory_order_relaxed); }
+  int64_t get() const { return _value.load(std::memory_order_relaxed); }
+  
+private:
+  std::atomic<int64_t> _value;
+  
+};
+
+struct ConnectionStats {
+  Counter linesin;
+  Counter framesin;
+  Counter bytesout;
+  Counter linesout;
+  Counter dropped;        // sends to a device that wasn't good
+  Counter busy;           // sends refused or dropped because the write queue was full
+  Counter discarded;      // bytes thrown away because the read queue filled without a whole line
+  Counter acks;           // credit given back by the device
+  Gauge handshake = -1;   // ms from opening until the ID, -1 until there is one
+  int reconnects = 0;     // times the path was connected before
+};
+
+// how long lines spend at each stage on the way to ZMQ, and sends on the
+// way to the device.
+struct LatencyStats {
+  Histogram serial;       // arrived from the device until the server read it
+  Histogram zmq;          // read until it was handed to ZMQ
+  Histogram dispatch;     // pulled from ZMQ until it was queued for the device
+  Histogram write;        // queued until it was written to the device
+  Histogram priority;     // the same for sends with a priority
+};
+
+struct ZMQStats {
+  Counter pulled;
+  Counter pushed;
+  Counter dropped;        // couldn't be pushed without waiting
+};
+
+struct StreamStats {
+  Counter sent;
+  Counter resent;
+  Counter acked;
+  Counter errors;
+  Counter timedout;       // given up on
+  Counter dropped;        // too many waiting to be sent
+};
+
+#endif // H_stats
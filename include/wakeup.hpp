@@ -0,0 +1,32 @@
+/*
+  wakeup.hpp
+  
+  A file descriptor that other threads can signal to wake up the server
+  loop while it is polling.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#ifndef H_wakeup
+#define H_wakeup
+
+class Wakeup {
+
+public:
+  Wakeup();
+  ~Wakeup();
+  
+  int fd() { return _fds[0]; }
+  void signal();
+  void drain();
+  
+private:
+  int _fds[2];
+  
+};
+
+#endif // H_wakeup
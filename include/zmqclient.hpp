@@ -6,6 +6,15 @@
     
   A ZMQ Client for Arduino integration.
   
+  Lines for the same stream can go together in one request.
+  
+  Objects are sent on a DEALER socket so that a window of them can be waiting
+  for a reply at once. Each has a correlation id, and any that aren't replied
+  to in time are sent again, so one whose reply was lost is added twice, and
+  with a window of more than one it can be added after ones sent later.
+  Batched lines go a request at a time so that they stay in order. The socket
+  is only used from the server loop.
+  
   This work is licensed under the Creative Commons Attribution 4.0 International License. 
   To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
   send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
@@ -18,38 +27,88 @@
 
 #include <string>
 #include <map>
+#include <deque>
+#include <chrono>
+#include <cstdint>
 #include <boost/json.hpp>
 #include <zmq.hpp>
 
+#include "stats.hpp"
+
 using namespace std;
 using json = boost::json::value;
 
 class Server;
 class Channel;
+struct ServerOptions;
 
 typedef function<void (json *)> msgHandler;
 
 class ZMQClient : public enable_shared_from_this<ZMQClient> {
 
 public:
-  ZMQClient(Server *server, int req);
+  ZMQClient(Server *server, int req, const ServerOptions &options);
   
-  void run();
   void send(const string &userid, const string &streamid, const string &seqid, const string &text);
+  
+  // the server loop polls the socket, calls receive when there is something
+  // to read and check to send again anything that timed out. check returns
+  // the ms until it needs to be called again, -1 if it doesn't.
+  zmq::socket_t &socket() { return *_dealer; }
+  void receive();
+  long check();
+  
+  size_t inflight() { return _inflight.size(); }
+  size_t queued() { return _queued.size(); }
+  
+  StreamStats _stats;
 
 private:
+  typedef chrono::steady_clock::time_point timepoint;
+  
+  struct Request {
+    uint64_t corr;
+    string body;
+    timepoint deadline;
+    int tries;
+    boost::json::array texts;   // the lines in a bulk request
+  };
+  
+  // lines for the same user, stream and sequence waiting to go together.
+  struct Batch {
+    string user;
+    string stream;
+    string sequence;
+    boost::json::array texts;
+    timepoint started;
+  };
+  
   Server *_server;
   shared_ptr<zmq::context_t> _context;
-  shared_ptr<zmq::socket_t> _req;
+  shared_ptr<zmq::socket_t> _dealer;
   map<string, msgHandler> _reqmessages;
+  deque<Request> _queued;             // waiting for room in the window
+  map<uint64_t, Request> _inflight;   // waiting for a reply, oldest first
+  map<string, Batch> _batches;
+  uint64_t _nextcorr;
+  size_t _window;
+  int _timeout;
+  int _retries;
+  size_t _batchsize;
+  int _batchlatency;
   
-  void receive();
+  static const size_t MAX_QUEUED = 4096;
   
   static bool getString(json *j, const string &name, string *value);
   static bool getBool(json *j, const string &name, bool *value);
+  static bool getCorr(json *j, uint64_t *corr);
+  static bool getIndex(json *j, uint64_t *index);
   static void handle_reply(const zmq::message_t &reply, map<string, msgHandler> *handlers, const string &name);
-  void send(const json &j);
+  void send(const json &j, boost::json::array texts = boost::json::array());
+  void flush(map<string, Batch>::iterator batch);
+  bool take(json *doc, Request *request);
   bool trySend(const string &m);
+  void sendqueued(timepoint now);
   
   // msg handlers
   void ackMsg(json *);
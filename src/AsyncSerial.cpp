@@ -32,14 +32,46 @@
 
 #include <string>
 #include <algorithm>
+#include <deque>
+#include <cstdint>
+#include <atomic>
+#include <sys/ioctl.h>
 //#include <thread>
 //#include <mutex>
 #include <boost/bind.hpp>
-#include <boost/shared_array.hpp>
 
 using namespace std;
 using namespace boost;
 
+//
+//Class SerialIoPool
+//
+
+SerialIoPool::SerialIoPool(size_t threads): io(), work(asio::make_work_guard(io))
+{
+    if(threads==0) threads=boost::thread::hardware_concurrency();
+    if(threads==0) threads=1;
+    for(size_t i=0;i<threads;i++)
+        this->threads.create_thread(boost::bind(&asio::io_service::run, &io));
+}
+
+SerialIoPool::~SerialIoPool()
+{
+    work.reset();
+    io.stop();
+    threads.join_all();
+}
+
+asio::io_service& SerialIoPool::service()
+{
+    return io;
+}
+
+size_t SerialIoPool::size() const
+{
+    return threads.size();
+}
+
 //
 //Class AsyncSerial
 //
@@ -49,25 +81,274 @@ using namespace boost;
 class AsyncSerialImpl: private boost::noncopyable
 {
 public:
-    AsyncSerialImpl(): io(), port(io), backgroundThread(), open(false),
-            error(false) {}
-
-    boost::asio::io_service io; ///< Io service object
+    AsyncSerialImpl(SerialIoPool *pool=0): ownIo(pool ? 0 : new asio::io_service),
+            io(pool ? pool->service() : *ownIo), strand(io), port(io),
+            backgroundThread(), pool(pool), open(false), error(false),
+            pending(0), writeOffset(0), writeScheduled(false), queuedCount(0),
+            writtenCount(0),
+            frontStart(0), maxQueued(0), maxWrites(0), dropOldest(false),
+            droppedCount(0), creditWindow(0), creditLeft(0),
+            writeStalled(false), writingFlow(false), pauseRequested(false),
+            readPaused(false) {}
+
+    std::unique_ptr<boost::asio::io_service> ownIo; ///< Io service if not pooled
+    /// Keeps ownIo running while the port is open, even when nothing is
+    /// being read or written
+    std::unique_ptr<boost::asio::executor_work_guard<
+            boost::asio::io_service::executor_type> > work;
+    boost::asio::io_service& io; ///< Io service object
+    boost::asio::io_service::strand strand; ///< Serializes this port's callbacks
     boost::asio::serial_port port; ///< Serial port object
     boost::thread backgroundThread; ///< Thread that runs read/write operations
+    SerialIoPool *pool; ///< Shared pool, or 0 if using backgroundThread
     bool open; ///< True if port open
     bool error; ///< Error flag
     mutable boost::mutex errorMutex; ///< Mutex for access to error
 
-    /// Data are queued here before they go in writeBuffer
+    size_t pending; ///< Operations posted or in progress on the io_service
+    boost::mutex pendingMutex; ///< Mutex for access to pending
+    boost::condition_variable pendingDone; ///< Signalled when pending is 0
+
+    /// Data are queued here while writeBuffer is being written, then the
+    /// two are swapped so neither is allocated or copied once they've grown
     std::vector<char> writeQueue;
-    boost::shared_array<char> writeBuffer; ///< Data being written
-    size_t writeBufferSize; ///< Size of writeBuffer
+    /// Chars at the front of writeQueue already moved to writeBuffer, which
+    /// happens a bit at a time with a credit window
+    size_t writeOffset;
+    std::vector<char> writeBuffer; ///< Data being written, only on the strand
+    /// A doWrite has been posted or a write is in progress, so anything
+    /// queued goes out with the next one. Protected by writeQueueMutex
+    bool writeScheduled;
     boost::mutex writeQueueMutex; ///< Mutex for access to writeQueue
+    uint64_t queuedCount; ///< Chars ever put in writeQueue
+    uint64_t writtenCount; ///< Chars ever written
+    /// A write not yet written
+    struct PendingWrite
+    {
+        uint64_t end; ///< Where it ends in queuedCount
+        std::chrono::steady_clock::time_point queued; ///< When it was queued
+        int priority; ///< Goes before less important writes
+    };
+    /// Every write not yet written, in the order they will be written
+    std::deque<PendingWrite> writeTimes;
+    uint64_t frontStart; ///< Where the first of writeTimes starts
+    /// Write complete callback, protected by writeQueueMutex
+    std::function<void (std::chrono::steady_clock::duration, int)>
+            writeCallback;
+    /// Called when everything queued has been written, protected by
+    /// writeQueueMutex
+    std::function<void ()> drainedCallback;
+    size_t maxQueued; ///< Most chars waiting to be written, 0 for no limit
+    size_t maxWrites; ///< Most writes waiting to be written, 0 for no limit
+    bool dropOldest; ///< Make room by dropping rather than refusing
+    uint64_t droppedCount; ///< Writes dropped to make room
+    size_t creditWindow; ///< Most chars written but not acknowledged, 0 for no limit
+    size_t creditLeft; ///< Chars that can be written before more credit
+    /// There is data queued but no credit, so nothing is being written
+    /// until addCredit(). Protected by writeQueueMutex
+    bool writeStalled;
+    /// Flow control chars, written before anything queued and not counted
+    /// as writes. Protected by writeQueueMutex
+    std::vector<char> flowQueue;
+    bool writingFlow; ///< writeBuffer is from flowQueue, only on the strand
     char readBuffer[AsyncSerial::readBufferSize]; ///< data being read
+    std::atomic<bool> pauseRequested; ///< Don't start another read
+    bool readPaused; ///< No read is in progress because of it, only on the strand
+
+    /**
+     * \return chars in writeQueue not yet moved to writeBuffer, call with
+     * writeQueueMutex locked
+     */
+    size_t unwritten() const
+    {
+        return writeQueue.size()-writeOffset;
+    }
+
+    /**
+     * Note that size chars were put in writeQueue, call with
+     * writeQueueMutex locked
+     */
+    void queued(size_t size, int priority)
+    {
+        if(writeTimes.empty()) frontStart=queuedCount;
+        queuedCount+=size;
+        writeTimes.push_back({queuedCount,std::chrono::steady_clock::now(),
+                priority});
+    }
+
+    /**
+     * Find where a write goes in writeTimes, which is after the writes that
+     * have started and any that are as important. Call with
+     * writeQueueMutex locked
+     * \param begin set to where it goes in queuedCount
+     * \return where it goes in writeTimes
+     */
+    std::deque<PendingWrite>::iterator lane(int priority, uint64_t& begin)
+    {
+        //A write that has been even partly taken out of writeQueue to be
+        //written has started, which only happens with a credit window
+        uint64_t start=queuedCount-unwritten();
+        begin=frontStart;
+        auto i=writeTimes.begin();
+        while(i!=writeTimes.end() && (begin<start || i->priority>=priority))
+            begin=(i++)->end;
+        return i;
+    }
+
+    /**
+     * \return true if size more chars would go over a limit, call with
+     * writeQueueMutex locked
+     */
+    bool full(size_t size)
+    {
+        //A write bigger than the limit still goes on its own
+        if(writeTimes.empty()) return false;
+        return (maxQueued>0 && queuedCount-writtenCount+size>maxQueued) ||
+                (maxWrites>0 && writeTimes.size()+1>maxWrites);
+    }
+
+    /**
+     * Drop the oldest write that hasn't started from the least important
+     * writes, call with writeQueueMutex locked
+     * \param most don't drop anything more important than this
+     * \return false if there isn't one
+     */
+    bool dropWrite(int most)
+    {
+        //The least important writes are always at the end
+        if(writeTimes.empty() || writeTimes.back().priority>most) return false;
+        int priority=writeTimes.back().priority;
+        uint64_t start=queuedCount-unwritten();
+        uint64_t begin=frontStart;
+        auto i=writeTimes.begin();
+        while(i!=writeTimes.end() && (begin<start || i->priority!=priority))
+            begin=(i++)->end;
+        if(i==writeTimes.end()) return false;
+        size_t len=i->end-begin;
+        auto from=writeQueue.begin()+writeOffset+(begin-start);
+        writeQueue.erase(from,from+len);
+        for(auto j=writeTimes.erase(i);j!=writeTimes.end();++j) j->end-=len;
+        queuedCount-=len;
+        droppedCount++;
+        return true;
+    }
+
+    /**
+     * Put data in writeQueue, call with writeQueueMutex locked
+     * \param post set to true if a doWrite needs to be posted for it
+     * \param priority goes before less important writes that haven't started
+     * \return false if there isn't room
+     */
+    bool queue(const char *data, size_t size, const char *delim, bool& post,
+            int priority)
+    {
+        post=false;
+        size_t total=size+(delim ? 1 : 0);
+        while(full(total))
+        {
+            //Writes that were taken are only ever dropped if that's the
+            //policy, and then the less important ones go first
+            if(!dropOldest) return false;
+            if(priority>0 && dropWrite(priority-1)) continue;
+            //Only what's being written, or more important, is left
+            if(!dropWrite(priority)) break;
+        }
+        uint64_t begin;
+        auto i=priority>0 ? lane(priority,begin) : writeTimes.end();
+        if(i==writeTimes.end())
+        {
+            writeQueue.insert(writeQueue.end(),data,data+size);
+            if(delim) writeQueue.push_back(*delim);
+            queued(total,priority);
+        } else {
+            //Whole writes move up to make room, so none is ever torn
+            auto at=writeQueue.end()-(queuedCount-begin);
+            at=writeQueue.insert(at,data,data+size)+size;
+            if(delim) writeQueue.insert(at,*delim);
+            for(auto j=i;j!=writeTimes.end();++j) j->end+=total;
+            writeTimes.insert(i,{begin+total,std::chrono::steady_clock::now(),
+                    priority});
+            queuedCount+=total;
+        }
+        if(captureCallback)
+        {
+            captureCallback(true,data,size);
+            if(delim) captureCallback(true,delim,1);
+        }
+        if(!writeScheduled)
+        {
+            writeScheduled=true;
+            post=true;
+        }
+        return true;
+    }
+
+    /**
+     * Move what there is credit for from writeQueue to the empty
+     * writeBuffer, call with writeQueueMutex locked
+     * \return false if there was nothing to move
+     */
+    bool nextWrite()
+    {
+        //Flow control goes first, whatever the limits or credit
+        writingFlow=!flowQueue.empty();
+        if(writingFlow)
+        {
+            writeBuffer.swap(flowQueue);
+            return true;
+        }
+        size_t size=unwritten();
+        if(size==0) return false;
+        if(size>AsyncSerial::writeCoalesceSize)
+        {
+            //As many whole writes as fit, or at least the first
+            uint64_t start=queuedCount-size;
+            size_t whole=0;
+            for(auto& w : writeTimes)
+            {
+                if(w.end<=start) continue;
+                if(whole>0 && w.end-start>AsyncSerial::writeCoalesceSize) break;
+                whole=w.end-start;
+            }
+            size=whole;
+        }
+        if(creditWindow>0)
+        {
+            size=std::min(size,creditLeft);
+            if(size==0)
+            {
+                writeStalled=true;
+                return false;
+            }
+            creditLeft-=size;
+        }
+        auto from=writeQueue.begin()+writeOffset;
+        if(writeOffset==0 && size==writeQueue.size())
+            writeBuffer.swap(writeQueue);
+        else if(size==unwritten()) {
+            writeBuffer.assign(from,writeQueue.end());
+            writeQueue.clear();
+            writeOffset=0;
+        } else {
+            writeBuffer.assign(from,from+size);
+            writeOffset+=size;
+            //Compact once what's been taken outgrows what's left, so a queue
+            //that never empties is still only copied a constant number of
+            //times per char
+            if(writeOffset>unwritten())
+            {
+                writeQueue.erase(writeQueue.begin(),writeQueue.begin()+writeOffset);
+                writeOffset=0;
+            }
+        }
+        return true;
+    }
 
     /// Read complete callback
     std::function<void (const char*, size_t)> callback;
+
+    /// Capture callback, set before the port is opened
+    std::function<void (bool, const char*, size_t)> captureCallback;
 };
 
 AsyncSerial::AsyncSerial(): pimpl(new AsyncSerialImpl)
@@ -75,6 +356,11 @@ AsyncSerial::AsyncSerial(): pimpl(new AsyncSerialImpl)
 
 }
 
+AsyncSerial::AsyncSerial(SerialIoPool *pool): pimpl(new AsyncSerialImpl(pool))
+{
+
+}
+
 AsyncSerial::AsyncSerial(const std::string& devname, unsigned int baud_rate,
         asio::serial_port_base::parity opt_parity,
         asio::serial_port_base::character_size opt_csize,
@@ -101,11 +387,37 @@ void AsyncSerial::open(const std::string& devname, unsigned int baud_rate,
     pimpl->port.set_option(opt_flow);
     pimpl->port.set_option(opt_stop);
 
+    {
+        //Anything left from before a close is never written
+        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+        pimpl->writeQueue.clear();
+        pimpl->writeOffset=0;
+        pimpl->writeBuffer.clear();
+        pimpl->writeScheduled=false;
+        pimpl->writtenCount=pimpl->queuedCount;
+        pimpl->writeTimes.clear();
+        pimpl->flowQueue.clear();
+        pimpl->writingFlow=false;
+        //A new device has an empty buffer
+        pimpl->creditLeft=pimpl->creditWindow;
+        pimpl->writeStalled=false;
+    }
+    pimpl->pauseRequested=false;
+    pimpl->readPaused=false;
+
     //This gives some work to the io_service before it is started
-    pimpl->io.post(boost::bind(&AsyncSerial::doRead, this));
+    startOp();
+    asio::post(pimpl->strand, boost::bind(&AsyncSerial::doRead, this));
 
-    boost::thread t(boost::bind(&asio::io_service::run, &pimpl->io));
-    pimpl->backgroundThread.swap(t);
+    if(!pimpl->pool)
+    {
+        //Reads can be paused and writes wait for credit, so there isn't
+        //always an operation keeping run() from returning
+        pimpl->work.reset(new asio::executor_work_guard<
+                asio::io_service::executor_type>(asio::make_work_guard(pimpl->io)));
+        boost::thread t(boost::bind(&asio::io_service::run, &pimpl->io));
+        pimpl->backgroundThread.swap(t);
+    }
     setErrorStatus(false);//If we get here, no error
     pimpl->open=true; //Port is now open
 }
@@ -121,14 +433,88 @@ bool AsyncSerial::errorStatus() const
     return pimpl->error;
 }
 
+size_t AsyncSerial::writePending() const
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    return pimpl->queuedCount-pimpl->writtenCount;
+}
+
+size_t AsyncSerial::writesPending() const
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    return pimpl->writeTimes.size();
+}
+
+uint64_t AsyncSerial::writesDropped() const
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    return pimpl->droppedCount;
+}
+
+void AsyncSerial::setWriteLimit(size_t chars, size_t writes, bool dropOldest)
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    pimpl->maxQueued=chars;
+    pimpl->maxWrites=writes;
+    pimpl->dropOldest=dropOldest;
+}
+
+void AsyncSerial::setCreditWindow(size_t chars)
+{
+    {
+        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+        //What was written and not acknowledged is still in the device's
+        //buffer, so it counts against the new window too
+        size_t unacked=pimpl->creditWindow>0 ?
+                pimpl->creditWindow-pimpl->creditLeft : 0;
+        pimpl->creditWindow=chars;
+        pimpl->creditLeft=chars>unacked ? chars-unacked : 0;
+        if(!pimpl->writeStalled || (chars>0 && pimpl->creditLeft==0)) return;
+        pimpl->writeStalled=false;
+    }
+    startOp();
+    asio::post(pimpl->strand, boost::bind(&AsyncSerial::doWrite, this));
+}
+
+void AsyncSerial::addCredit(size_t chars)
+{
+    {
+        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+        if(pimpl->creditWindow==0) return;
+        pimpl->creditLeft=std::min(pimpl->creditWindow,pimpl->creditLeft+chars);
+        if(!pimpl->writeStalled) return;
+        pimpl->writeStalled=false;
+    }
+    //Writing stopped for want of credit, so start it again
+    startOp();
+    asio::post(pimpl->strand, boost::bind(&AsyncSerial::doWrite, this));
+}
+
+size_t AsyncSerial::credit() const
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    return pimpl->creditWindow>0 ? pimpl->creditLeft : 0;
+}
+
 void AsyncSerial::close()
 {
     if(!isOpen()) return;
 
     pimpl->open=false;
-    pimpl->io.post(boost::bind(&AsyncSerial::doClose, this));
-    pimpl->backgroundThread.join();
-    pimpl->io.reset();
+    startOp();
+    asio::post(pimpl->strand, [this]() { doClose(); endOp(); });
+    if(pimpl->pool)
+    {
+        //The pool's threads keep running, so wait for this port's
+        //operations (including the aborted ones) to finish instead
+        boost::unique_lock<boost::mutex> l(pimpl->pendingMutex);
+        while(pimpl->pending>0) pimpl->pendingDone.wait(l);
+    } else {
+        //run() returns once the close and the aborted operations are done
+        pimpl->work.reset();
+        pimpl->backgroundThread.join();
+        pimpl->io.reset();
+    }
     if(errorStatus())
     {
         throw(boost::system::system_error(boost::system::error_code(),
@@ -136,32 +522,41 @@ void AsyncSerial::close()
     }
 }
 
-void AsyncSerial::write(const char *data, size_t size)
+bool AsyncSerial::write(const char *data, size_t size)
 {
-    {
-        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
-        pimpl->writeQueue.insert(pimpl->writeQueue.end(),data,data+size);
-    }
-    pimpl->io.post(boost::bind(&AsyncSerial::doWrite, this));
+    return queueWrite(data,size,0);
 }
 
-void AsyncSerial::write(const std::vector<char>& data)
+bool AsyncSerial::write(const std::vector<char>& data)
 {
-    {
-        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
-        pimpl->writeQueue.insert(pimpl->writeQueue.end(),data.begin(),
-                data.end());
-    }
-    pimpl->io.post(boost::bind(&AsyncSerial::doWrite, this));
+    return queueWrite(data.data(),data.size(),0);
+}
+
+bool AsyncSerial::writeString(const std::string& s)
+{
+    return queueWrite(s.data(),s.size(),0);
 }
 
-void AsyncSerial::writeString(const std::string& s)
+bool AsyncSerial::writeLine(const std::string& s, char delim, int priority)
 {
+    return queueWrite(s.data(),s.size(),&delim,priority);
+}
+
+bool AsyncSerial::queueWrite(const char *data, size_t size, const char *delim,
+        int priority)
+{
+    bool post;
     {
         boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
-        pimpl->writeQueue.insert(pimpl->writeQueue.end(),s.begin(),s.end());
+        if(!pimpl->queue(data,size,delim,post,priority)) return false;
     }
-    pimpl->io.post(boost::bind(&AsyncSerial::doWrite, this));
+    //Writes made while one is already on its way are coalesced into the next
+    if(post)
+    {
+        startOp();
+        asio::post(pimpl->strand, boost::bind(&AsyncSerial::doWrite, this));
+    }
+    return true;
 }
 
 AsyncSerial::~AsyncSerial()
@@ -179,11 +574,12 @@ AsyncSerial::~AsyncSerial()
 
 void AsyncSerial::doRead()
 {
+    //The caller has already counted this read with startOp()
     pimpl->port.async_read_some(asio::buffer(pimpl->readBuffer,readBufferSize),
-            boost::bind(&AsyncSerial::readEnd,
+            asio::bind_executor(pimpl->strand, boost::bind(&AsyncSerial::readEnd,
             this,
             asio::placeholders::error,
-            asio::placeholders::bytes_transferred));
+            asio::placeholders::bytes_transferred)));
 }
 
 void AsyncSerial::readEnd(const boost::system::error_code& error,
@@ -196,7 +592,9 @@ void AsyncSerial::readEnd(const boost::system::error_code& error,
         {
             //Bug on OS X, it might be necessary to repeat the setup
             //http://osdir.com/ml/lib.boost.asio.user/2008-08/msg00004.html
+            startOp();
             doRead();
+            endOp();
             return;
         }
         #endif //__APPLE__
@@ -208,53 +606,126 @@ void AsyncSerial::readEnd(const boost::system::error_code& error,
             setErrorStatus(true);
         }
     } else {
+        if(pimpl->captureCallback) pimpl->captureCallback(false,
+                pimpl->readBuffer,bytes_transferred);
         if(pimpl->callback) pimpl->callback(pimpl->readBuffer,
                 bytes_transferred);
-        doRead();
+        //The callback may have asked for a pause, resumeReading() restarts
+        if(pimpl->pauseRequested) pimpl->readPaused=true;
+        else {
+            startOp();
+            doRead();
+        }
     }
+    endOp();
+}
+
+void AsyncSerial::pauseReading()
+{
+    pimpl->pauseRequested=true;
+}
+
+void AsyncSerial::resumeReading()
+{
+    if(!pimpl->pauseRequested.exchange(false)) return;
+    //If readEnd hasn't seen the pause yet it just carries on reading
+    startOp();
+    asio::post(pimpl->strand, [this]() {
+        if(pimpl->readPaused && isOpen())
+        {
+            pimpl->readPaused=false;
+            startOp();
+            doRead();
+        }
+        endOp();
+    });
+}
+
+void AsyncSerial::writeFlowControl(char c)
+{
+    {
+        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+        pimpl->flowQueue.push_back(c);
+        if(pimpl->captureCallback) pimpl->captureCallback(true,&c,1);
+        //Waiting for credit doesn't hold it up either
+        if(pimpl->writeScheduled && !pimpl->writeStalled) return;
+        pimpl->writeScheduled=true;
+        pimpl->writeStalled=false;
+    }
+    startOp();
+    asio::post(pimpl->strand, boost::bind(&AsyncSerial::doWrite, this));
+}
+
+bool AsyncSerial::setRTS(bool on)
+{
+    int flag=TIOCM_RTS;
+    return ::ioctl(pimpl->port.native_handle(),on ? TIOCMBIS : TIOCMBIC,
+            &flag)==0;
 }
 
 void AsyncSerial::doWrite()
 {
-    //If a write operation is already in progress, do nothing
-    if(pimpl->writeBuffer==0)
+    //Only posted when no write is in progress, everything queued since
+    //goes out in one write
+    startWrite();
+    endOp();
+}
+
+bool AsyncSerial::startWrite()
+{
     {
         boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
-        pimpl->writeBufferSize=pimpl->writeQueue.size();
-        pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-        copy(pimpl->writeQueue.begin(),pimpl->writeQueue.end(),
-                pimpl->writeBuffer.get());
-        pimpl->writeQueue.clear();
-        async_write(pimpl->port,asio::buffer(pimpl->writeBuffer.get(),
-                pimpl->writeBufferSize),
-                boost::bind(&AsyncSerial::writeEnd, this, asio::placeholders::error));
+        if(!pimpl->nextWrite())
+        {
+            //When it's waiting for credit addCredit() posts another doWrite
+            if(!pimpl->writeStalled) pimpl->writeScheduled=false;
+            return false;
+        }
     }
+    startOp();
+    async_write(pimpl->port,asio::buffer(pimpl->writeBuffer),
+            asio::bind_executor(pimpl->strand, boost::bind(
+            &AsyncSerial::writeEnd, this, asio::placeholders::error)));
+    return true;
 }
 
 void AsyncSerial::writeEnd(const boost::system::error_code& error)
 {
     if(!error)
     {
-        boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
-        if(pimpl->writeQueue.empty())
+        bool more;
         {
-            pimpl->writeBuffer.reset();
-            pimpl->writeBufferSize=0;
-            
-            return;
+            boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+            if(!pimpl->writingFlow)
+                pimpl->writtenCount+=pimpl->writeBuffer.size();
+            pimpl->writeBuffer.clear();
+            if(!pimpl->writeTimes.empty())
+            {
+                auto now=std::chrono::steady_clock::now();
+                while(!pimpl->writeTimes.empty() &&
+                        pimpl->writeTimes.front().end<=pimpl->writtenCount)
+                {
+                    if(pimpl->writeCallback)
+                        pimpl->writeCallback(now-pimpl->writeTimes.front().queued,
+                                pimpl->writeTimes.front().priority);
+                    pimpl->frontStart=pimpl->writeTimes.front().end;
+                    pimpl->writeTimes.pop_front();
+                }
+            }
+            more=pimpl->unwritten()>0 || !pimpl->flowQueue.empty();
+            if(!more)
+            {
+                pimpl->writeScheduled=false;
+                if(pimpl->drainedCallback) pimpl->drainedCallback();
+            }
         }
-        pimpl->writeBufferSize=pimpl->writeQueue.size();
-        pimpl->writeBuffer.reset(new char[pimpl->writeQueue.size()]);
-        copy(pimpl->writeQueue.begin(),pimpl->writeQueue.end(),
-                pimpl->writeBuffer.get());
-        pimpl->writeQueue.clear();
-        async_write(pimpl->port,asio::buffer(pimpl->writeBuffer.get(),
-                pimpl->writeBufferSize),
-                boost::bind(&AsyncSerial::writeEnd, this, asio::placeholders::error));
+        //Only this strand takes from writeQueue, so it's still not empty
+        if(more) startWrite();
     } else {
         setErrorStatus(true);
         doClose();
     }
+    endOp();
 }
 
 void AsyncSerial::doClose()
@@ -266,6 +737,20 @@ void AsyncSerial::doClose()
     if(ec) setErrorStatus(true);
 }
 
+void AsyncSerial::startOp()
+{
+    boost::lock_guard<boost::mutex> l(pimpl->pendingMutex);
+    pimpl->pending++;
+}
+
+void AsyncSerial::endOp()
+{
+    //Keep the impl alive, close() may return as soon as pending reaches 0
+    std::shared_ptr<AsyncSerialImpl> impl(pimpl);
+    boost::lock_guard<boost::mutex> l(impl->pendingMutex);
+    if(--impl->pending==0) impl->pendingDone.notify_all();
+}
+
 void AsyncSerial::setErrorStatus(bool e)
 {
     boost::lock_guard<boost::mutex> l(pimpl->errorMutex);
@@ -283,6 +768,25 @@ void AsyncSerial::clearReadCallback()
     pimpl->callback.swap(empty);
 }
 
+void AsyncSerial::setWriteCallback(
+        const std::function<void (std::chrono::steady_clock::duration, int)>& callback)
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    pimpl->writeCallback=callback;
+}
+
+void AsyncSerial::setCaptureCallback(
+        const std::function<void (bool, const char*, size_t)>& callback)
+{
+    pimpl->captureCallback=callback;
+}
+
+void AsyncSerial::setDrainedCallback(const std::function<void ()>& callback)
+{
+    boost::lock_guard<boost::mutex> l(pimpl->writeQueueMutex);
+    pimpl->drainedCallback=callback;
+}
+
 #else //__APPLE__
 
 #include <sys/types.h>
@@ -290,11 +794,14 @@ void AsyncSerial::clearReadCallback()
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 class AsyncSerialImpl: private boost::noncopyable
 {
 public:
-    AsyncSerialImpl(): backgroundThread(), open(false), error(false) {}
+    //Reads are blocking on OS X, so a pool can't be shared and is ignored
+    AsyncSerialImpl(SerialIoPool *pool=0): backgroundThread(), open(false),
+            error(false), pauseRequested(false) {}
 
     boost::thread backgroundThread; ///< Thread that runs read operations
     bool open; ///< True if port open
@@ -305,8 +812,36 @@ public:
     
     char readBuffer[AsyncSerial::readBufferSize]; ///< data being read
 
+    bool pauseRequested; ///< Don't read again, protected by pauseMutex
+    boost::mutex pauseMutex; ///< Mutex for access to pauseRequested
+    boost::condition_variable resumed; ///< Signalled when it's cleared
+
     /// Read complete callback
     std::function<void (const char*, size_t)> callback;
+
+    /// Write complete callback
+    std::function<void (std::chrono::steady_clock::duration, int)> writeCallback;
+
+    /// Capture callback, set before the port is opened
+    std::function<void (bool, const char*, size_t)> captureCallback;
+
+    /**
+     * Write data, writes are synchronous here
+     */
+    bool write(const char *data, size_t size, const char *delim=0,
+            int priority=0)
+    {
+        if(captureCallback) captureCallback(true,data,size);
+        if(delim && captureCallback) captureCallback(true,delim,1);
+        auto start=std::chrono::steady_clock::now();
+        //The delimiter goes in the same syscall without copying the data
+        struct iovec iov[2]={ { (void*)data, size }, { (void*)delim, 1 } };
+        ssize_t total=size+(delim ? 1 : 0);
+        bool ok=total==0 || ::writev(fd,iov,delim ? 2 : 1)==total;
+        if(writeCallback) writeCallback(std::chrono::steady_clock::now()-start,
+                priority);
+        return ok;
+    }
 };
 
 AsyncSerial::AsyncSerial(): pimpl(new AsyncSerialImpl)
@@ -314,6 +849,11 @@ AsyncSerial::AsyncSerial(): pimpl(new AsyncSerialImpl)
 
 }
 
+AsyncSerial::AsyncSerial(SerialIoPool *pool): pimpl(new AsyncSerialImpl(pool))
+{
+
+}
+
 AsyncSerial::AsyncSerial(const std::string& devname, unsigned int baud_rate,
         asio::serial_port_base::parity opt_parity,
         asio::serial_port_base::character_size opt_csize,
@@ -410,6 +950,7 @@ void AsyncSerial::open(const std::string& devname, unsigned int baud_rate,
 
     setErrorStatus(false);//If we get here, no error
     pimpl->open=true; //Port is now open
+    pimpl->pauseRequested=false;
 
     boost::thread t(bind(&AsyncSerial::doRead, this));
     pimpl->backgroundThread.swap(t);
@@ -426,11 +967,52 @@ bool AsyncSerial::errorStatus() const
     return pimpl->error;
 }
 
+size_t AsyncSerial::writePending() const
+{
+    //Writes are synchronous here
+    return 0;
+}
+
+size_t AsyncSerial::writesPending() const
+{
+    return 0;
+}
+
+uint64_t AsyncSerial::writesDropped() const
+{
+    return 0;
+}
+
+void AsyncSerial::setWriteLimit(size_t chars, size_t writes, bool dropOldest)
+{
+    //Nothing waits to be written, so there's nothing to limit
+}
+
+void AsyncSerial::setCreditWindow(size_t chars)
+{
+    //Writes are synchronous, waiting for credit would hold up the caller
+}
+
+void AsyncSerial::addCredit(size_t chars)
+{
+    //There's never a window
+}
+
+size_t AsyncSerial::credit() const
+{
+    return 0;
+}
+
 void AsyncSerial::close()
 {
     if(!isOpen()) return;
 
-    pimpl->open=false;
+    {
+        //The thread may be waiting for reading to be resumed instead
+        boost::lock_guard<boost::mutex> l(pimpl->pauseMutex);
+        pimpl->open=false;
+        pimpl->resumed.notify_all();
+    }
 
     ::close(pimpl->fd); //The thread waiting on I/O should return
 
@@ -443,20 +1025,29 @@ void AsyncSerial::close()
     }
 }
 
-void AsyncSerial::write(const char *data, size_t size)
+bool AsyncSerial::write(const char *data, size_t size)
 {
-    if(::write(pimpl->fd,data,size)!=size) setErrorStatus(true);
+    if(!pimpl->write(data,size)) setErrorStatus(true);
+    return true;
 }
 
-void AsyncSerial::write(const std::vector<char>& data)
+bool AsyncSerial::write(const std::vector<char>& data)
 {
-    if(::write(pimpl->fd,&data[0],data.size())!=data.size())
-        setErrorStatus(true);
+    if(!pimpl->write(data.data(),data.size())) setErrorStatus(true);
+    return true;
+}
+
+bool AsyncSerial::writeString(const std::string& s)
+{
+    if(!pimpl->write(s.data(),s.size())) setErrorStatus(true);
+    return true;
 }
 
-void AsyncSerial::writeString(const std::string& s)
+bool AsyncSerial::writeLine(const std::string& s, char delim, int priority)
 {
-    if(::write(pimpl->fd,&s[0],s.size())!=s.size()) setErrorStatus(true);
+    //Nothing ever waits, so there's nothing to go ahead of
+    if(!pimpl->write(s.data(),s.size(),&delim,priority)) setErrorStatus(true);
+    return true;
 }
 
 AsyncSerial::~AsyncSerial()
@@ -486,10 +1077,44 @@ void AsyncSerial::doRead()
                 continue;
             }
         }
+        if(pimpl->captureCallback) pimpl->captureCallback(false,
+                pimpl->readBuffer,received);
         if(pimpl->callback) pimpl->callback(pimpl->readBuffer, received);
+        boost::unique_lock<boost::mutex> l(pimpl->pauseMutex);
+        while(pimpl->pauseRequested && isOpen()) pimpl->resumed.wait(l);
     }
 }
 
+void AsyncSerial::pauseReading()
+{
+    boost::lock_guard<boost::mutex> l(pimpl->pauseMutex);
+    pimpl->pauseRequested=true;
+}
+
+void AsyncSerial::resumeReading()
+{
+    boost::lock_guard<boost::mutex> l(pimpl->pauseMutex);
+    pimpl->pauseRequested=false;
+    pimpl->resumed.notify_all();
+}
+
+void AsyncSerial::writeFlowControl(char c)
+{
+    if(!pimpl->write(&c,1)) setErrorStatus(true);
+}
+
+bool AsyncSerial::setRTS(bool on)
+{
+    int flag=TIOCM_RTS;
+    return ::ioctl(pimpl->fd,on ? TIOCMBIS : TIOCMBIC,&flag)==0;
+}
+
+bool AsyncSerial::startWrite()
+{
+    //Not used
+    return false;
+}
+
 void AsyncSerial::readEnd(const boost::system::error_code& error,
         size_t bytes_transferred)
 {
@@ -511,6 +1136,16 @@ void AsyncSerial::doClose()
     //Not used
 }
 
+void AsyncSerial::startOp()
+{
+    //Not used
+}
+
+void AsyncSerial::endOp()
+{
+    //Not used
+}
+
 void AsyncSerial::setErrorStatus(bool e)
 {
     boost::lock_guard<boost::mutex> l(pimpl->errorMutex);
@@ -528,6 +1163,23 @@ void AsyncSerial::clearReadCallback()
     pimpl->callback.swap(empty);
 }
 
+void AsyncSerial::setWriteCallback(
+        const std::function<void (std::chrono::steady_clock::duration, int)>& callback)
+{
+    pimpl->writeCallback=callback;
+}
+
+void AsyncSerial::setCaptureCallback(
+        const std::function<void (bool, const char*, size_t)>& callback)
+{
+    pimpl->captureCallback=callback;
+}
+
+void AsyncSerial::setDrainedCallback(const std::function<void ()>& callback)
+{
+    //Writes are synchronous, so it's never needed
+}
+
 #endif //__APPLE__
 
 //
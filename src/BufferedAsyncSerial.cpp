@@ -10,6 +10,7 @@
 #include "BufferedAsyncSerial.h"
 
 #include <string>
+#include <cstring>
 #include <algorithm>
 
 using namespace std;
@@ -19,7 +20,20 @@ using namespace boost;
 //Class BufferedAsyncSerial
 //
 
-BufferedAsyncSerial::BufferedAsyncSerial(): AsyncSerial()
+BufferedAsyncSerial::BufferedAsyncSerial(): AsyncSerial(),
+        readQueue(readQueueSize), lineDelim('\n'), anyData(false),
+        receivedCount(0),
+        readHigh(0), readLow(0), flowSignal(none), readPaused(false),
+        overflowCount(0)
+{
+    setReadCallback(std::bind(&BufferedAsyncSerial::readCallback, this, std::placeholders::_1, std::placeholders::_2));
+}
+
+BufferedAsyncSerial::BufferedAsyncSerial(SerialIoPool *pool): AsyncSerial(pool),
+        readQueue(readQueueSize), lineDelim('\n'), anyData(false),
+        receivedCount(0),
+        readHigh(0), readLow(0), flowSignal(none), readPaused(false),
+        overflowCount(0)
 {
     setReadCallback(std::bind(&BufferedAsyncSerial::readCallback, this, std::placeholders::_1, std::placeholders::_2));
 }
@@ -30,7 +44,11 @@ BufferedAsyncSerial::BufferedAsyncSerial(const std::string& devname,
         asio::serial_port_base::character_size opt_csize,
         asio::serial_port_base::flow_control opt_flow,
         asio::serial_port_base::stop_bits opt_stop)
-        :AsyncSerial(devname,baud_rate,opt_parity,opt_csize,opt_flow,opt_stop)
+        :AsyncSerial(devname,baud_rate,opt_parity,opt_csize,opt_flow,opt_stop),
+        readQueue(readQueueSize), lineDelim('\n'), anyData(false),
+        receivedCount(0),
+        readHigh(0), readLow(0), flowSignal(none), readPaused(false),
+        overflowCount(0)
 {
     setReadCallback(std::bind(&BufferedAsyncSerial::readCallback, this, std::placeholders::_1,std::placeholders:: _2));
 }
@@ -38,75 +56,199 @@ BufferedAsyncSerial::BufferedAsyncSerial(const std::string& devname,
 size_t BufferedAsyncSerial::read(char *data, size_t size)
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    size_t result=min(size,readQueue.size());
-    vector<char>::iterator it=readQueue.begin()+result;
-    copy(readQueue.begin(),it,data);
-    readQueue.erase(readQueue.begin(),it);
+    size_t result=readQueue.read(data,size);
+    takeArrival();
     return result;
 }
 
 std::vector<char> BufferedAsyncSerial::read()
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    vector<char> result;
-    result.swap(readQueue);
+    vector<char> result(readQueue.size());
+    readQueue.read(result.data(),result.size());
+    takeArrival();
     return result;
 }
 
 std::string BufferedAsyncSerial::readString()
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    string result(readQueue.begin(),readQueue.end());
-    readQueue.clear();
+    string result(readQueue.size(),'\0');
+    readQueue.read(&result[0],result.size());
+    takeArrival();
     return result;
 }
 
 std::string BufferedAsyncSerial::readStringUntil(const std::string delim)
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    vector<char>::iterator it=findStringInVector(readQueue,delim);
-    if(it==readQueue.end()) return "";
-    string result(readQueue.begin(),it);
-    it+=delim.size();//Do remove the delimiter from the queue
-    readQueue.erase(readQueue.begin(),it);
+    string result;
+    readQueue.readUntil(delim,result);
+    takeArrival();
     return result;
 }
 
-void BufferedAsyncSerial::readCallback(const char *data, size_t len)
+bool BufferedAsyncSerial::readLineUntil(std::string& line,
+        const std::string& delim)
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    readQueue.insert(readQueue.end(),data,data+len);
+    if(!readQueue.readUntil(delim,line)) return false;
+    takeArrival();
+    return true;
 }
 
-void BufferedAsyncSerial::clear()
+bool BufferedAsyncSerial::readPrefixedFrame(std::string& frame)
 {
     boost::lock_guard<boost::mutex> l(readQueueMutex);
-    readQueue.clear();
+    if(readQueue.size()<2) return false;
+    unsigned char prefix[2];
+    readQueue.peek(reinterpret_cast<char*>(prefix),2);
+    size_t len=prefix[0] | (prefix[1]<<8);
+    if(readQueue.size()<len+2) return false;
+    readQueue.consume(2);
+    frame.resize(len);
+    readQueue.read(&frame[0],len);
+    takeArrival();
+    return true;
 }
 
-std::vector<char>::iterator BufferedAsyncSerial::findStringInVector(
-        std::vector<char>& v,const std::string& s)
+size_t BufferedAsyncSerial::available()
 {
-    if(s.size()==0) return v.end();
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    return readQueue.size();
+}
 
-    vector<char>::iterator it=v.begin();
-    for(;;)
-    {
-        vector<char>::iterator result=find(it,v.end(),s[0]);
-        if(result==v.end()) return v.end();//If not found return
+uint64_t BufferedAsyncSerial::received() const
+{
+    return receivedCount.load(std::memory_order_relaxed);
+}
 
-        for(size_t i=0;i<s.size();i++)
+std::chrono::steady_clock::time_point BufferedAsyncSerial::lastArrival()
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    return lastArrivalTime;
+}
+
+void BufferedAsyncSerial::takeArrival()
+{
+    //The last char read came with the first chunk that ends after it
+    uint64_t taken=receivedCount.load(std::memory_order_relaxed)-readQueue.size();
+    while(!arrivals.empty() && arrivals.front().first<taken)
+        arrivals.pop_front();
+    if(!arrivals.empty()) lastArrivalTime=arrivals.front().second;
+    checkResume();
+}
+
+void BufferedAsyncSerial::checkResume()
+{
+    if(!readPaused || readQueue.size()>readLow) return;
+    restartReading();
+}
+
+void BufferedAsyncSerial::restartReading()
+{
+    readPaused=false;
+    if(flowSignal==software) writeFlowControl('\x11'); //XON
+    else if(flowSignal==hardware) setRTS(true);
+    resumeReading();
+}
+
+size_t BufferedAsyncSerial::highMark() const
+{
+    size_t most=readQueue.capacity()-readBufferSize;
+    return readHigh>0 ? min(readHigh,most) : most;
+}
+
+void BufferedAsyncSerial::readCallback(const char *data, size_t len)
+{
+    std::function<void ()> notify;
+    {
+        boost::lock_guard<boost::mutex> l(readQueueMutex);
+        readQueue.append(data,len);
+        uint64_t end=receivedCount.fetch_add(len,std::memory_order_relaxed)+len;
+        arrivals.push_back(std::make_pair(end,std::chrono::steady_clock::now()));
+        //Stop reading before it starts the next read, and tell the device
+        //to stop sending. Only what's already on its way arrives after
+        bool paused=false;
+        if(!readPaused && readQueue.size()>=highMark())
         {
-            vector<char>::iterator temp=result+i;
-            if(temp==v.end()) return v.end();
-            if(s[i]!=*temp) goto mismatch;
+            readPaused=paused=true;
+            overflowCount.fetch_add(1,std::memory_order_relaxed);
+            pauseReading();
+            if(flowSignal==software) writeFlowControl('\x13'); //XOFF
+            else if(flowSignal==hardware) setRTS(false);
         }
-        //Found
-        return result;
+        if(lineCallback && (anyData || paused ||
+                memchr(data,lineDelim,len)!=0))
+            notify=lineCallback;
+    }
+    //Called without the lock so the reader can go straight for the line
+    if(notify) notify();
+}
+
+void BufferedAsyncSerial::setLineCallback(
+        const std::function<void ()>& callback, char delim)
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    lineCallback=callback;
+    lineDelim=delim;
+    anyData=false;
+}
+
+void BufferedAsyncSerial::setDataCallback(
+        const std::function<void ()>& callback)
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    lineCallback=callback;
+    anyData=true;
+}
 
-        mismatch:
-        it=result+1;
+void BufferedAsyncSerial::setReadLimit(size_t high, size_t low,
+        FlowSignal signal)
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    //The queue only grows here, so that the limit plus a read always fits
+    if(high+readBufferSize>readQueue.capacity())
+    {
+        RingBuffer bigger(high+readBufferSize);
+        vector<char> waiting(readQueue.size());
+        readQueue.read(waiting.data(),waiting.size());
+        bigger.append(waiting.data(),waiting.size());
+        readQueue=std::move(bigger);
     }
+    readHigh=high;
+    readLow=min(low,high);
+    flowSignal=signal;
+    checkResume();
+}
+
+bool BufferedAsyncSerial::readingPaused()
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    return readPaused;
+}
+
+bool BufferedAsyncSerial::unblockReading()
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    if(!readPaused) return true;
+    if(readQueue.size()>=highMark()) return false;
+    //It stops again if it gets to the limit
+    restartReading();
+    return true;
+}
+
+uint64_t BufferedAsyncSerial::overflows() const
+{
+    return overflowCount.load(std::memory_order_relaxed);
+}
+
+void BufferedAsyncSerial::clear()
+{
+    boost::lock_guard<boost::mutex> l(readQueueMutex);
+    readQueue.clear();
+    arrivals.clear();
+    checkResume();
 }
 
 BufferedAsyncSerial::~BufferedAsyncSerial()
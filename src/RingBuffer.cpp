@@ -0,0 +1,123 @@
+/*
+  RingBuffer.cpp
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "RingBuffer.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+//
+//Class RingBuffer
+//
+
+const size_t RingBuffer::npos;
+
+RingBuffer::RingBuffer(size_t capacity): head(0), count(0), scanned(0)
+{
+    size_t c=1;
+    while(c<capacity) c<<=1;
+    buf.resize(c);
+}
+
+size_t RingBuffer::append(const char *data, size_t len)
+{
+    len=min(len,buf.size()-count);
+    size_t mask=buf.size()-1;
+    size_t tail=(head+count)&mask;
+    size_t first=min(len,buf.size()-tail);
+    memcpy(&buf[tail],data,first);
+    memcpy(&buf[0],data+first,len-first);
+    count+=len;
+    return len;
+}
+
+size_t RingBuffer::read(char *data, size_t size)
+{
+    size_t result=min(size,count);
+    peek(data,result);
+    consume(result);
+    return result;
+}
+
+bool RingBuffer::readUntil(const std::string& delim, std::string& line)
+{
+    size_t pos=find(delim);
+    if(pos==npos) return false;
+    line.resize(pos);
+    if(pos>0) peek(&line[0],pos);
+    consume(pos+delim.size());//Do remove the delimiter from the buffer
+    return true;
+}
+
+size_t RingBuffer::find(const std::string& delim)
+{
+    if(delim.empty()) return npos;
+    if(delim!=lastDelim)
+    {
+        lastDelim=delim;
+        scanned=0;
+    }
+    if(count<delim.size()) return npos;
+
+    //Only positions where the whole delimiter fits can match
+    size_t last=count-delim.size()+1;
+    size_t mask=buf.size()-1;
+    size_t from=scanned;
+    while(from<last)
+    {
+        //Look for the first char with memchr, one contiguous piece at a time
+        size_t start=(head+from)&mask;
+        size_t len=min(last-from,buf.size()-start);
+        const char *p=static_cast<const char*>(
+                memchr(&buf[start],delim[0],len));
+        if(p==0)
+        {
+            from+=len;
+            continue;
+        }
+        size_t pos=from+(p-&buf[start]);
+        size_t i=1;
+        while(i<delim.size() && at(pos+i)==delim[i]) i++;
+        if(i==delim.size())
+        {
+            scanned=pos;
+            return pos;
+        }
+        from=pos+1;
+    }
+    scanned=last;
+    return npos;
+}
+
+void RingBuffer::consume(size_t len)
+{
+    len=min(len,count);
+    head=(head+len)&(buf.size()-1);
+    count-=len;
+    scanned=scanned>len ? scanned-len : 0;
+    if(count==0) head=0;
+}
+
+void RingBuffer::peek(char *data, size_t len) const
+{
+    len=min(len,count);
+    size_t first=min(len,buf.size()-head);
+    memcpy(data,&buf[head],first);
+    memcpy(data+first,&buf[0],len-first);
+}
+
+void RingBuffer::clear()
+{
+    head=0;
+    count=0;
+    scanned=0;
+}
@@ -0,0 +1,202 @@
+/*
+  capture.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "capture.hpp"
+
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/log/trivial.hpp>
+#include <boost/system/system_error.hpp>
+
+using namespace std;
+
+const char Capture::MAGIC[8] = { 'Z', 'M', 'Q', 'A', 'C', 'A', 'P', '1' };
+
+static size_t pad(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+Capture::Capture(const string &filename): _map(0), _mapstart(0), _maplen(0),
+    _end(sizeof(MAGIC) + sizeof(uint64_t)), _stopped(false), _start(chrono::steady_clock::now()) {
+
+  _fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (_fd < 0) {
+    throw boost::system::system_error(errno, boost::system::system_category(), filename);
+  }
+
+  int err = remap(0);
+  if (err) {
+    ::close(_fd);
+    throw boost::system::system_error(err, boost::system::system_category(), filename);
+  }
+  memcpy(_map, MAGIC, sizeof(MAGIC));
+  uint64_t started = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  memcpy(_map + sizeof(MAGIC), &started, sizeof(started));
+
+  BOOST_LOG_TRIVIAL(info) << "capturing to " << filename;
+
+}
+
+Capture::~Capture() {
+
+  // the file was grown a window at a time, so cut it back to what was used.
+  unmap();
+  if (ftruncate(_fd, _end) < 0) {
+    BOOST_LOG_TRIVIAL(error) << "couldn't trim capture";
+  }
+  ::close(_fd);
+
+}
+
+void Capture::record(Kind kind, const string &path, const char *data, size_t len) {
+
+  Header h;
+  h.kind = kind;
+  h.unused = 0;
+  h.pathlen = path.size();
+  h.size = sizeof(h) + h.pathlen + len;
+  size_t padded = pad(h.size);
+
+  lock_guard<mutex> l(_mutex);
+
+  // it's already said why, once.
+  if (_stopped) {
+    return;
+  }
+
+  h.ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - _start).count();
+
+  // always leave room for the 0 at the end.
+  if (_end + padded + sizeof(h.size) > _mapstart + _maplen) {
+    if (remap(padded + sizeof(h.size))) {
+      _stopped = true;
+      return;
+    }
+  }
+
+  // the size goes in last so a reader never sees half a record.
+  char *p = _map + (_end - _mapstart);
+  memcpy(p + sizeof(h.size), (char *)&h + sizeof(h.size), sizeof(h) - sizeof(h.size));
+  memcpy(p + sizeof(h), path.data(), h.pathlen);
+  memcpy(p + sizeof(h) + h.pathlen, data, len);
+  memcpy(p, &h.size, sizeof(h.size));
+  _end += padded;
+
+}
+
+uint64_t Capture::size() {
+
+  lock_guard<mutex> l(_mutex);
+  return _end;
+
+}
+
+int Capture::remap(size_t need) {
+
+  unmap();
+
+  // only the end of the file is mapped, from the page the next record is in.
+  size_t page = sysconf(_SC_PAGESIZE);
+  _mapstart = _end / page * page;
+  size_t len = max(WINDOW, (_end - _mapstart + need + page - 1) / page * page);
+
+  // the space is taken now, since running out while writing to the map
+  // would be a SIGBUS.
+#ifdef __linux__
+  int err = posix_fallocate(_fd, _mapstart, len);
+#else
+  int err = ftruncate(_fd, _mapstart + len) < 0 ? errno : 0;
+#endif
+  if (err) {
+    BOOST_LOG_TRIVIAL(error) << "capture stopped, couldn't grow the file: " << strerror(err);
+    return err;
+  }
+  void *map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _mapstart);
+  if (map == MAP_FAILED) {
+    err = errno;
+    BOOST_LOG_TRIVIAL(error) << "capture stopped, couldn't map the file: " << strerror(err);
+    return err;
+  }
+  _map = (char *)map;
+  _maplen = len;
+  return 0;
+
+}
+
+void Capture::unmap() {
+
+  if (_map) {
+    munmap(_map, _maplen);
+    _map = 0;
+    _maplen = 0;
+  }
+
+}
+
+CaptureReader::CaptureReader(const string &filename): _map(0), _len(0), _pos(0), _started(0) {
+
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw boost::system::system_error(errno, boost::system::system_category(), filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw boost::system::system_error(err, boost::system::system_category(), filename);
+  }
+  _len = st.st_size;
+  if (_len < sizeof(Capture::MAGIC) + sizeof(uint64_t)) {
+    ::close(fd);
+    throw boost::system::system_error(EINVAL, boost::system::system_category(), filename + " is too short");
+  }
+  void *map = mmap(0, _len, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    throw boost::system::system_error(err, boost::system::system_category(), filename);
+  }
+  _map = (const char *)map;
+  if (memcmp(_map, Capture::MAGIC, sizeof(Capture::MAGIC)) != 0) {
+    munmap((void *)_map, _len);
+    throw boost::system::system_error(EINVAL, boost::system::system_category(), filename + " isn't a capture");
+  }
+  memcpy(&_started, _map + sizeof(Capture::MAGIC), sizeof(_started));
+  _pos = sizeof(Capture::MAGIC) + sizeof(uint64_t);
+
+}
+
+CaptureReader::~CaptureReader() {
+  munmap((void *)_map, _len);
+}
+
+bool CaptureReader::next(Record *record) {
+
+  // a capture that wasn't closed ends in zeros.
+  Capture::Header h;
+  if (_pos + sizeof(h) > _len) {
+    return false;
+  }
+  memcpy(&h, _map + _pos, sizeof(h));
+  if (h.size < sizeof(h) + h.pathlen || _pos + h.size > _len) {
+    return false;
+  }
+  record->kind = (Capture::Kind)h.kind;
+  record->ns = h.ns;
+  const char *p = _map + _pos + sizeof(h);
+  record->path = string_view(p, h.pathlen);
+  record->data = string_view(p + h.pathlen, h.size - sizeof(h) - h.pathlen);
+  _pos += pad(h.size);
+  return true;
+
+}
@@ -0,0 +1,36 @@
+/*
+  cobs.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "cobs.hpp"
+
+using namespace std;
+
+bool cobsdecode(const string &in, string *out) {
+
+  out->clear();
+  out->reserve(in.size());
+  
+  // each code byte is 1 more than the number of bytes that follow it before
+  // the next 0. 0xff means 254 bytes with no 0 after them.
+  size_t i = 0;
+  while (i < in.size()) {
+    unsigned char code = in[i++];
+    if (code == 0 || i + code - 1 > in.size()) {
+      return false;
+    }
+    out->append(in, i, code - 1);
+    i += code - 1;
+    if (code != 0xff && i < in.size()) {
+      out->push_back('\0');
+    }
+  }
+  return true;
+  
+}
@@ -16,17 +16,70 @@
 #include "server.hpp"
 #include "zmqclient.hpp"
 #include "BufferedAsyncSerial.h"
+#include "cobs.hpp"
 #include <nlohmann/json.hpp>
 #include <iostream>
+#include <cmath>
+#include <cstdlib>
 #include <boost/algorithm/string.hpp>
 #include <boost/log/trivial.hpp>
 
 using namespace std;
 using njson = nlohmann::json;
 
+Connection::Connection(const string &path, BufferedAsyncSerial *serial): _path(path), 
+    _baud(0), _backlog(0), _maxbacklog(0), _serial(serial), _state(SETTLING), _probes(0), _backlogwarn(BACKLOG_WARN), 
+    _framing(LINES), _creditwindow(0), _full(false), _writesdropped(0) {
+
+  if (_serial) {
+    _serial->setWriteCallback([this](chrono::steady_clock::duration d, int priority) {
+      (priority > 0 ? _latency.priority : _latency.write).record(d);
+    });
+  }
+
+  string device;
+  MsgBuf::escape(&device, path.data(), path.size());
+  _devicemsg = "{\"device\":\"" + device + "\"}";
+  _sentmsg = "{\"sent\":\"" + device + "\"}";
+  _removedmsg = "{\"removed\":\"" + device + "\"}";
+  _drainedmsg = "{\"drained\":\"" + device + "\"}";
+  _receivedprefix = "{\"device\":\"" + device + "\",\"data\":\"";
+  _rawmsg = "{\"raw\":\"" + device + "\"}";
+  
+}
+
+void Connection::renderid() {
+
+  string device, name;
+  MsgBuf::escape(&device, _path.data(), _path.size());
+  MsgBuf::escape(&name, _id->data(), _id->size());
+  _idmsg = "{\"id\":{\"device\":\"" + device + "\",\"name\":\"" + name + "\"}}";
+  
+}
+
 void Connection::describe(ostream &str) {
   str << (_id ? *_id : "no id");
   str << " (" << _path << ")";
+  switch (_state) {
+  case SETTLING:
+    str << ", settling";
+    break;
+  case PROBING:
+    str << ", waiting for id";
+    break;
+  case NOID:
+    str << ", didn't reply to ID";
+    break;
+  case VERIFYING:
+    str << ", checking id";
+    break;
+  case STALE:
+    str << ", not the id it had";
+    break;
+  default:
+    break;
+  }
+  str << ", backlog " << _backlog << " (max " << _maxbacklog << ")";
   if (_serial) {
     str << (_serial->isOpen() ? ", opened" : ", unopened");
   }
@@ -37,9 +90,7 @@ void Connection::describe(ostream &str) {
 
 void Connection::added(Server *server) {
 
-  njson msg;
-  msg["device"] = _path;
-  server->sendjson(msg);
+  server->send(_devicemsg);
   
   if (_id) {
     sendid(server);
@@ -49,48 +100,290 @@ void Connection::added(Server *server) {
 
 void Connection::sendid(Server *server) {
 
-  njson data;
-  data["device"] = _path;
-  data["name"] = *_id;
-  njson msg;
-  msg["id"] = data;
-  server->sendjson(msg);
+  server->send(_idmsg);
   
 }
 
-void Connection::doread(Server *server) {
+void Connection::sent(Server *server) {
+  server->send(_sentmsg);
+}
 
-  if (_serial) {
-    stringstream s;
-    s << _serial->readStringUntil("\n");
-    string st = s.str();
-    if (st.length() > 0) {
-      boost::trim(st);
-      if (_waitingid) {
-        _waitingid = false;
-        _id = st;
-        sendid(server);
-        BOOST_LOG_TRIVIAL(info) << "added ";
-        stringstream ss;
-        describe(ss);
-        BOOST_LOG_TRIVIAL(info) << ss.str();
+void Connection::removed(Server *server) {
+  server->send(_removedmsg);
+}
+
+void Connection::checkdrained(Server *server) {
+
+  if (_full && writequeue() == 0) {
+    _full = false;
+    server->send(_drainedmsg);
+  }
+  
+}
+
+bool Connection::doread(Server *server, int budget) {
+
+  if (!_serial) {
+    return false;
+  }
+  
+  // take every line that has arrived, but only up to the budget so that
+  // a chatty device can't starve the others.
+  // a read queue that stays paused after reading has no whole line in it.
+  bool paused = _serial->readingPaused();
+  uint64_t overflows = _serial->overflows();
+  
+  string st;
+  int lines = 0;
+  if (_framing == LINES || handshaking()) {
+    while (lines < budget && _serial->readLineUntil(st)) {
+      lines++;
+      if (takecredit(st)) {
+        continue;
       }
-      else {
-        if (_stream.empty()) {
-          njson data;
-          data["device"] = _path;
-          data["data"] = st;
-          njson msg;
-          msg["received"] = data;
-          server->sendjson(msg);
-          BOOST_LOG_TRIVIAL(info) << s.str();
-        }
-        else {
-          server->_zmq->send(_user, _stream, _sequence, st);
+      _stats.linesin.add();
+      timepoint read = chrono::steady_clock::now();
+      _latency.serial.record(read - _serial->lastArrival());
+      if (st.length() > 0) {
+        bool handshake = handshaking();
+        handleline(server, st);
+        if (!handshake) {
+          _latency.zmq.record(chrono::steady_clock::now() - read);
         }
       }
     }
   }
+  else {
+    // frames go into the buffer that is sent, with no conversion.
+    MsgBuf *buf = 0;
+    while (lines < budget) {
+      if (!buf) {
+        buf = server->getbuf();
+      }
+      if (!readframe(&buf->_data)) {
+        break;
+      }
+      lines++;
+      _stats.framesin.add();
+      timepoint read = chrono::steady_clock::now();
+      _latency.serial.record(read - _serial->lastArrival());
+      server->sendframe(_rawmsg, buf);
+      _latency.zmq.record(chrono::steady_clock::now() - read);
+      buf = 0;
+    }
+    if (buf) {
+      server->putbuf(buf);
+    }
+  }
+  
+  // reading has stopped and there is nothing whole to read, so nothing
+  // would ever start it again. If there's still room the rest of it can 
+  // be read, otherwise it never will be.
+  if (paused && lines < budget && _serial->readingPaused() && _serial->overflows() == overflows &&
+      !_serial->unblockReading()) {
+    size_t n = _serial->available();
+    _serial->clear();
+    _stats.discarded.add(n);
+    BOOST_LOG_TRIVIAL(warning) << _path << " filled the read queue without a whole line, " << n << " bytes thrown away";
+  }
+  
+  _backlog = _serial->available();
+  if (_backlog > _maxbacklog) {
+    _maxbacklog = _backlog;
+  }
+  if (_backlog >= _backlogwarn) {
+    BOOST_LOG_TRIVIAL(warning) << _path << " is falling behind, backlog " << _backlog;
+    _backlogwarn *= 2;
+  }
+  else if (_backlog == 0) {
+    _backlogwarn = BACKLOG_WARN;
+  }
+  
+  // there may be more lines waiting.
+  return lines >= budget;
+  
+}
+
+void Connection::handleline(Server *server, string &st) {
+
+  boost::trim(st);
+  if (_state == SETTLING) {
+    // the arduino is still resetting, this is just boot noise.
+    BOOST_LOG_TRIVIAL(debug) << "ignoring " << st << " from " << _path << " while it settles";
+  }
+  else if (_state == PROBING) {
+    if (!isid(st)) {
+      BOOST_LOG_TRIVIAL(debug) << "ignoring " << st << " from " << _path << " while waiting for the id";
+      return;
+    }
+    _state = IDENTIFIED;
+    _id = st;
+    renderid();
+    server->identified(this);
+    sendid(server);
+    _stats.handshake.set(chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - _opened).count());
+    BOOST_LOG_TRIVIAL(info) << "added in " << _stats.handshake.get() << "ms";
+    stringstream ss;
+    describe(ss);
+    BOOST_LOG_TRIVIAL(info) << ss.str();
+  }
+  else if (_state == VERIFYING && st == *_id) {
+    // the reply to the ID probe, not data.
+    _state = IDENTIFIED;
+    BOOST_LOG_TRIVIAL(debug) << _path << " is still " << st;
+  }
+  else {
+    if (_stream.empty()) {
+      server->received(_receivedprefix, st);
+      BOOST_LOG_TRIVIAL(info) << st;
+    }
+    else {
+      server->_zmq->send(_user, _stream, _sequence, st);
+    }
+  }
+  
+}
+
+bool Connection::takecredit(const string &line) {
+
+  // an ack is only for us, the client never sees it.
+  if (_creditwindow == 0 || line.empty() || line[0] != CREDIT_ACK) {
+    return false;
+  }
+  _serial->addCredit(strtoul(line.c_str() + 1, 0, 10));
+  _stats.acks.add();
+  return true;
+  
+}
+
+bool Connection::readframe(string *frame) {
+
+  if (_framing == LENGTH) {
+    return _serial->readPrefixedFrame(*frame);
+  }
+  
+  static const string zero(1, '\0');
+  while (_serial->readLineUntil(_encoded, zero)) {
+    // a 0 on its own can be used to make sure the next frame starts clean.
+    if (_encoded.empty()) {
+      continue;
+    }
+    if (cobsdecode(_encoded, frame)) {
+      return true;
+    }
+    BOOST_LOG_TRIVIAL(debug) << "bad frame from " << _path;
+  }
+  return false;
+  
+}
+
+bool Connection::setframing(Framing framing, const function<void ()> &wakeup) {
+
+  if (framing != LINES && _creditwindow > 0) {
+    return false;
+  }
+  _framing = framing;
+  if (_framing == LENGTH) {
+    _serial->setDataCallback(wakeup);
+  }
+  else {
+    _serial->setLineCallback(wakeup, _framing == COBS ? '\0' : '\n');
+  }
+  return true;
+  
+}
+
+bool Connection::setcredit(size_t window) {
+
+  if (window > 0 && _framing != LINES) {
+    return false;
+  }
+  _creditwindow = window;
+  _serial->setCreditWindow(window);
+  return true;
+  
+}
+
+void Connection::assumeid(const string &id, const ServerOptions &options) {
+
+  _id = id;
+  renderid();
+  _state = VERIFYING;
+  _probes = 0;
+  _opened = chrono::steady_clock::now();
+  _deadline = _opened + chrono::milliseconds(options.settle);
+  _stats.handshake.set(0);
+  
+}
+
+void Connection::starthandshake(const ServerOptions &options) {
+
+  _state = SETTLING;
+  _probes = 0;
+  _opened = chrono::steady_clock::now();
+  _deadline = _opened + chrono::milliseconds(options.settle);
+  
+}
+
+boost::optional<timepoint> Connection::handshake(const ServerOptions &options, timepoint now) {
+
+  if (!_serial || (_state != SETTLING && _state != PROBING && _state != VERIFYING)) {
+    return boost::none;
+  }
+  
+  if (now >= _deadline) {
+    if (_state == VERIFYING) {
+      if (_probes > options.idretries) {
+        // the server starts again with it.
+        _state = STALE;
+        BOOST_LOG_TRIVIAL(warning) << _path << " didn't reply " << *_id << " after " << _probes << " tries";
+        return boost::none;
+      }
+      probe(options, now, false);
+      return _deadline;
+    }
+    if (_probes > options.idretries) {
+      // it's still usable by its path.
+      _state = NOID;
+      BOOST_LOG_TRIVIAL(info) << "no id from " << _path << " after " << _probes << " tries";
+      return boost::none;
+    }
+    probe(options, now, true);
+  }
+  return _deadline;
+  
+}
+
+void Connection::probe(const ServerOptions &options, timepoint now, bool clear) {
+
+  // only a reply to this probe can be the ID. When checking an ID the 
+  // lines that are waiting are data, so they stay.
+  if (clear) {
+    _serial->clear();
+  }
+  _serial->writeString("ID\n");
+  
+  long timeout = lround(options.idtimeout * pow(options.idbackoff, _probes));
+  _probes++;
+  if (_state != VERIFYING) {
+    _state = PROBING;
+  }
+  _deadline = now + chrono::milliseconds(timeout);
+  
+}
+
+bool Connection::isid(const string &line) {
+
+  // garbage from a baud rate mismatch or a half line is not an ID.
+  if (line.empty() || line.length() > MAX_ID) {
+    return false;
+  }
+  for (auto c: line) {
+    if (c < 0x20 || c > 0x7e) {
+      return false;
+    }
+  }
+  return true;
   
 }
 
@@ -116,6 +409,43 @@ bool Connection::isgood() {
   return _serial && _serial->isOpen() && !_serial->errorStatus();
 }
 
-void Connection::write(const string &data) {
-  _serial->writeString(data + "\n");
+bool Connection::write(const string &data, int priority) {
+
+  if (!_serial->writeLine(data, '\n', priority)) {
+    _full = true;
+    _stats.busy.add();
+    return false;
+  }
+  _stats.bytesout.add(data.size() + 1);
+  _stats.linesout.add();
+  
+  // older writes may have been dropped to make room.
+  uint64_t dropped = _serial->writesDropped();
+  if (dropped != _writesdropped) {
+    _full = true;
+    _stats.busy.add(dropped - _writesdropped);
+    _writesdropped = dropped;
+  }
+  return true;
+  
+}
+
+uint64_t Connection::bytesin() {
+  return _serial ? _serial->received() : 0;
+}
+
+uint64_t Connection::overflows() {
+  return _serial ? _serial->overflows() : 0;
+}
+
+size_t Connection::writequeue() {
+  return _serial ? _serial->writePending() : 0;
+}
+
+size_t Connection::writes() {
+  return _serial ? _serial->writesPending() : 0;
+}
+
+size_t Connection::credit() {
+  return _serial ? _serial->credit() : 0;
 }
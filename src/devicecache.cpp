@@ -0,0 +1,139 @@
+/*
+  devicecache.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "devicecache.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+using njson = nlohmann::json;
+namespace fs = std::filesystem;
+
+DeviceCache::DeviceCache(const string &filename): _filename(filename) {
+
+  ifstream f(_filename);
+  if (!f) {
+    BOOST_LOG_TRIVIAL(info) << "new device cache " << _filename;
+    return;
+  }
+  
+  // a broken cache only costs a handshake, so start again.
+  try {
+    njson doc = njson::parse(f);
+    for (auto &i: doc.items()) {
+      CachedDevice dev;
+      dev.id = i.value().at("id").get<string>();
+      dev.baud = i.value().at("baud").get<int>();
+      _devices[i.key()] = dev;
+    }
+  }
+  catch (njson::exception &e) {
+    BOOST_LOG_TRIVIAL(warning) << "ignoring device cache " << _filename << ": " << e.what();
+    _devices.clear();
+  }
+  BOOST_LOG_TRIVIAL(info) << _devices.size() << " devices in cache " << _filename;
+  
+}
+
+boost::optional<CachedDevice> DeviceCache::get(const string &key) {
+
+  auto i = _devices.find(key);
+  if (i == _devices.end()) {
+    return boost::none;
+  }
+  return i->second;
+  
+}
+
+void DeviceCache::put(const string &key, const CachedDevice &dev) {
+
+  auto i = _devices.find(key);
+  if (i != _devices.end() && i->second.id == dev.id && i->second.baud == dev.baud) {
+    return;
+  }
+  _devices[key] = dev;
+  save();
+  
+}
+
+void DeviceCache::forget(const string &key) {
+
+  if (_devices.erase(key)) {
+    save();
+  }
+  
+}
+
+void DeviceCache::save() {
+
+  njson doc = njson::object();
+  for (auto &i: _devices) {
+    doc[i.first] = { { "id", i.second.id }, { "baud", i.second.baud } };
+  }
+  
+  // written to the side and moved over so a crash never leaves half a file.
+  string tmp = _filename + ".tmp";
+  {
+    ofstream f(tmp);
+    f << doc.dump(2) << endl;
+    if (!f) {
+      BOOST_LOG_TRIVIAL(error) << "couldn't write device cache " << tmp;
+      return;
+    }
+  }
+  error_code ec;
+  fs::rename(tmp, _filename, ec);
+  if (ec) {
+    BOOST_LOG_TRIVIAL(error) << "couldn't replace device cache " << _filename << ": " << ec.message();
+  }
+  
+}
+
+string DeviceCache::readattr(const string &dir, const string &name) {
+
+  ifstream f(dir + "/" + name);
+  string s;
+  getline(f, s);
+  boost::trim(s);
+  return s;
+  
+}
+
+boost::optional<string> DeviceCache::usbkey(const string &root, const string &path) {
+
+  // the node might be a link, like those in /dev/serial/by-id.
+  error_code ec;
+  fs::path node = fs::canonical(path, ec);
+  if (ec) {
+    return boost::none;
+  }
+  
+  // class/tty/ttyUSB0/device is the USB interface, and the USB device with
+  // the IDs is above that. The serial driver can put more levels in between.
+  fs::path dir = fs::canonical(fs::path(root) / "class" / "tty" / node.filename() / "device", ec);
+  for (int i=0; !ec && i<4 && dir.has_relative_path(); i++, dir = dir.parent_path()) {
+    string vid = readattr(dir.string(), "idVendor");
+    string pid = readattr(dir.string(), "idProduct");
+    if (vid.empty() || pid.empty()) {
+      continue;
+    }
+    string serial = readattr(dir.string(), "serial");
+    if (serial.empty()) {
+      return boost::none;
+    }
+    return vid + ":" + pid + ":" + serial;
+  }
+  return boost::none;
+  
+}
@@ -0,0 +1,95 @@
+/*
+  histogram.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "histogram.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+Histogram::Histogram(): _count(0), _max(0) {
+  for (auto &c: _counts) {
+    c.store(0, memory_order_relaxed);
+  }
+}
+
+void Histogram::record(chrono::nanoseconds d) {
+
+  int64_t ns = d.count();
+  if (ns < 0) {
+    ns = 0;
+  }
+  _counts[bucket(ns)].fetch_add(1, memory_order_relaxed);
+  _count.fetch_add(1, memory_order_relaxed);
+  
+  int64_t m = _max.load(memory_order_relaxed);
+  while (ns > m && !_max.compare_exchange_weak(m, ns, memory_order_relaxed)) {
+  }
+  
+}
+
+int Histogram::bucket(uint64_t ns) {
+
+  if (ns >= (1ULL << MAX_BITS)) {
+    ns = (1ULL << MAX_BITS) - 1;
+  }
+  if (ns < SUB) {
+    return ns;
+  }
+  
+  // the top SUB_BITS + 1 bits pick the bucket within the power of 2.
+  int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+  return (shift + 1) * SUB + (ns >> shift) - SUB;
+  
+}
+
+int64_t Histogram::value(int bucket) {
+
+  if (bucket < SUB) {
+    return bucket;
+  }
+  
+  // the middle of the bucket.
+  int shift = bucket / SUB - 1;
+  int64_t low = (int64_t)(bucket % SUB + SUB) << shift;
+  return low + ((1LL << shift) >> 1);
+  
+}
+
+int64_t Histogram::percentile(double p) const {
+
+  uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t want = (uint64_t)ceil(p * total);
+  if (want == 0) {
+    want = 1;
+  }
+  uint64_t seen = 0;
+  for (int i=0; i<BUCKETS; i++) {
+    seen += _counts[i].load(memory_order_relaxed);
+    if (seen >= want) {
+      // never more than the biggest there has been.
+      int64_t v = value(i);
+      return v > max() ? max() : v;
+    }
+  }
+  return max();
+  
+}
+
+void Histogram::describe(ostream &str) const {
+  str << "p50 " << percentile(0.5) / 1000 << "us";
+  str << " p99 " << percentile(0.99) / 1000 << "us";
+  str << " p999 " << percentile(0.999) / 1000 << "us";
+  str << " max " << max() / 1000 << "us";
+  str << " (" << count() << ")";
+}
@@ -0,0 +1,96 @@
+/*
+  hotplug.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "hotplug.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <filesystem>
+#include <boost/log/trivial.hpp>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#ifdef __linux__
+
+Hotplug::Hotplug(const string &dir) : _dir(dir), _fd(-1) {
+
+  _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_fd < 0) {
+    BOOST_LOG_TRIVIAL(warning) << "inotify unavailable: " << strerror(errno);
+    return;
+  }
+  if (inotify_add_watch(_fd, _dir.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB) < 0) {
+    BOOST_LOG_TRIVIAL(warning) << "can't watch " << _dir << ": " << strerror(errno);
+    close(_fd);
+    _fd = -1;
+  }
+  
+}
+
+Hotplug::~Hotplug() {
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool Hotplug::read(vector<Event> *events) {
+
+  bool complete = true;
+  
+  // events are variable length, so read them in a buffer aligned for them.
+  alignas(struct inotify_event) char buf[4096];
+  while (1) {
+    ssize_t len = ::read(_fd, buf, sizeof(buf));
+    if (len <= 0) {
+      break;
+    }
+    for (char *p = buf; p < buf + len; ) {
+      struct inotify_event *e = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + e->len;
+      if (e->mask & IN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      if (e->len == 0) {
+        continue;
+      }
+      string path = (fs::path(_dir) / e->name).string();
+      if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+        events->push_back({ added, path });
+      }
+      else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        events->push_back({ removed, path });
+      }
+      else if (e->mask & IN_ATTRIB) {
+        events->push_back({ changed, path });
+      }
+    }
+  }
+  return complete;
+  
+}
+
+#else
+
+Hotplug::Hotplug(const string &dir) : _dir(dir), _fd(-1) {
+}
+
+Hotplug::~Hotplug() {
+}
+
+bool Hotplug::read(vector<Event> *events) {
+  return false;
+}
+
+#endif
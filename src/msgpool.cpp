@@ -0,0 +1,227 @@
+/*
+  msgpool.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "msgpool.hpp"
+
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+int MsgBuf::overflow(int c) {
+
+  if (c != EOF) {
+    _data.push_back((char)c);
+  }
+  return c;
+  
+}
+
+streamsize MsgBuf::xsputn(const char *s, streamsize n) {
+
+  _data.append(s, n);
+  return n;
+  
+}
+
+bool MsgBuf::plain(const char *s, size_t len) {
+
+  // check 8 chars at a time for anything under 0x20, over 0x7f, a quote or 
+  // a backslash.
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t x;
+    memcpy(&x, s + i, 8);
+    uint64_t quote = x ^ (ones * '"');
+    uint64_t slash = x ^ (ones * '\\');
+    // the top bit of a byte is set by (v - 1) & ~v when it's zero, and
+    // by (v - 0x20) & ~v when it's under 0x20.
+    uint64_t bad = ((x - ones * 0x20) & ~x) | ((quote - ones) & ~quote) | 
+      ((slash - ones) & ~slash) | x;
+    if (bad & highs) {
+      return false;
+    }
+  }
+  for (; i < len; i++) {
+    unsigned char c = s[i];
+    if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') {
+      return false;
+    }
+  }
+  return true;
+  
+}
+
+void MsgBuf::escape(string *out, const char *s, size_t len) {
+
+  static const char hex[] = "0123456789abcdef";
+  
+  if (plain(s, len)) {
+    out->append(s, len);
+    return;
+  }
+  
+  // copy runs of chars that don't need escaping in one go.
+  const unsigned char *u = (const unsigned char *)s;
+  size_t start = 0;
+  size_t i = 0;
+  while (i < len) {
+    unsigned char c = u[i];
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+      i++;
+      continue;
+    }
+    size_t n = 0;
+    if (c >= 0x80 && (n = utf8len(u + i, len - i)) > 0) {
+      i += n;
+      continue;
+    }
+    out->append(s + start, i - start);
+    switch (c) {
+    case '"':
+      out->append("\\\"", 2);
+      break;
+    case '\\':
+      out->append("\\\\", 2);
+      break;
+    case '\n':
+      out->append("\\n", 2);
+      break;
+    case '\r':
+      out->append("\\r", 2);
+      break;
+    case '\t':
+      out->append("\\t", 2);
+      break;
+    default:
+      if (c >= 0x80) {
+        out->append("\\ufffd", 6);
+      }
+      else {
+        char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+        out->append(esc, 6);
+      }
+      break;
+    }
+    i++;
+    start = i;
+  }
+  out->append(s + start, len - start);
+  
+}
+
+size_t MsgBuf::utf8len(const unsigned char *s, size_t len) {
+
+  // the length of a valid UTF-8 sequence at s, or 0. Overlong forms and
+  // surrogates aren't valid.
+  unsigned char c = s[0];
+  size_t n;
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf) {
+    n = 2;
+  }
+  else if (c >= 0xe0 && c <= 0xef) {
+    n = 3;
+    if (c == 0xe0) {
+      lo = 0xa0;
+    }
+    else if (c == 0xed) {
+      hi = 0x9f;
+    }
+  }
+  else if (c >= 0xf0 && c <= 0xf4) {
+    n = 4;
+    if (c == 0xf0) {
+      lo = 0x90;
+    }
+    else if (c == 0xf4) {
+      hi = 0x8f;
+    }
+  }
+  else {
+    return 0;
+  }
+  if (len < n || s[1] < lo || s[1] > hi) {
+    return 0;
+  }
+  for (size_t i=2; i<n; i++) {
+    if (s[i] < 0x80 || s[i] > 0xbf) {
+      return 0;
+    }
+  }
+  return n;
+  
+}
+
+MsgPool::MsgPool(size_t keep) : _keep(keep), _created(0) {
+}
+
+MsgPool::~MsgPool() {
+  for (auto i : _free) {
+    delete i;
+  }
+}
+
+MsgBuf *MsgPool::get() {
+
+  MsgBuf *buf = 0;
+  {
+    lock_guard<mutex> l(_mutex);
+    if (!_free.empty()) {
+      buf = _free.back();
+      _free.pop_back();
+    }
+    else {
+      _created++;
+    }
+  }
+  if (!buf) {
+    buf = new MsgBuf();
+  }
+  
+  // a buffer that is out keeps the pool alive, since ZMQ might give it
+  // back after the server has gone.
+  buf->_pool = shared_from_this();
+  return buf;
+  
+}
+
+void MsgPool::put(MsgBuf *buf) {
+
+  // the buffer keeps its capacity for next time.
+  buf->_data.clear();
+  buf->_stream.clear();
+  msgPoolPtr self;
+  self.swap(buf->_pool);
+  
+  lock_guard<mutex> l(_mutex);
+  if (_free.size() < _keep) {
+    _free.push_back(buf);
+  }
+  else {
+    delete buf;
+  }
+  
+}
+
+zmq::message_t MsgPool::message(MsgBuf *buf) {
+  return zmq::message_t((void *)buf->_data.data(), buf->_data.size(), &MsgPool::release, buf);
+}
+
+void MsgPool::release(void *, void *hint) {
+
+  // called from ZMQ's io thread.
+  MsgBuf *buf = (MsgBuf *)hint;
+  msgPoolPtr pool = buf->_pool;
+  pool->put(buf);
+  
+}
@@ -0,0 +1,159 @@
+/*
+  registry.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "registry.hpp"
+
+#include <new>
+
+using namespace std;
+
+Registry::Registry() : _free(NONE), _slots(0), _added(0) {
+}
+
+Registry::~Registry() {
+  clear();
+}
+
+Connection *Registry::add(const string &path, BufferedAsyncSerial *serial) {
+
+  // take a free slot, or start a new slab if there aren't any.
+  if (_free == NONE) {
+    _slabs.push_back(unique_ptr<Slot[]>(new Slot[SLAB_SIZE]));
+    for (uint32_t i=0; i<SLAB_SIZE; i++) {
+      Slot *s = slot(_slots + i);
+      s->generation = 1;
+      s->used = false;
+      s->nextfree = i + 1 < SLAB_SIZE ? _slots + i + 1 : NONE;
+    }
+    _free = _slots;
+    _slots += SLAB_SIZE;
+  }
+  uint32_t index = _free;
+  Slot *s = slot(index);
+  _free = s->nextfree;
+  
+  Connection *c = new (s->storage) Connection(path, serial);
+  c->_handle.index = index;
+  c->_handle.generation = s->generation;
+  s->used = true;
+  s->live = _live.size();
+  s->added = _added++;
+  _live.push_back(c);
+  _bypath[path] = c->_handle;
+  if (!get(_first)) {
+    _first = c->_handle;
+  }
+  return c;
+  
+}
+
+void Registry::remove(Connection *c) {
+
+  ConnectionHandle handle = c->_handle;
+  Slot *s = slot(handle.index);
+  
+  auto p = _bypath.find(c->_path);
+  if (p != _bypath.end() && p->second == handle) {
+    _bypath.erase(p);
+  }
+  if (c->id()) {
+    auto i = _byid.find(*c->id());
+    if (i != _byid.end() && i->second == handle) {
+      // another device might have the same ID, the one that has been around
+      // the longest gets it.
+      _byid.erase(i);
+      Connection *next = 0;
+      for (auto j : _live) {
+        if (j != c && j->id() == c->id() && (!next || slot(j->_handle.index)->added < slot(next->_handle.index)->added)) {
+          next = j;
+        }
+      }
+      if (next) {
+        _byid[*c->id()] = next->_handle;
+      }
+    }
+  }
+  
+  // move the last live one into its place.
+  Connection *last = _live.back();
+  _live[s->live] = last;
+  slot(last->_handle.index)->live = s->live;
+  _live.pop_back();
+  
+  c->~Connection();
+  s->used = false;
+  if (++s->generation == 0) {
+    s->generation = 1;
+  }
+  s->nextfree = _free;
+  _free = handle.index;
+  
+  if (handle == _first) {
+    _first = ConnectionHandle();
+    uint64_t oldest = 0;
+    for (auto j : _live) {
+      Slot *js = slot(j->_handle.index);
+      if (!get(_first) || js->added < oldest) {
+        _first = j->_handle;
+        oldest = js->added;
+      }
+    }
+  }
+  
+}
+
+void Registry::clear() {
+  while (!_live.empty()) {
+    remove(_live.back());
+  }
+}
+
+void Registry::identified(Connection *c) {
+
+  if (c->id() && !findid(*c->id())) {
+    _byid[*c->id()] = c->_handle;
+  }
+  
+}
+
+Connection *Registry::get(const ConnectionHandle &handle) {
+
+  if (handle.index >= _slots) {
+    return 0;
+  }
+  Slot *s = slot(handle.index);
+  if (!s->used || s->generation != handle.generation) {
+    return 0;
+  }
+  return conn(s);
+  
+}
+
+Connection *Registry::lookup(unordered_map<string, ConnectionHandle> &index, const string &key) {
+
+  auto i = index.find(key);
+  if (i == index.end()) {
+    return 0;
+  }
+  return get(i->second);
+  
+}
+
+Connection *Registry::findid(const string &id) {
+  return lookup(_byid, id);
+}
+
+Connection *Registry::findpath(const string &path) {
+  return lookup(_bypath, path);
+}
+
+Connection *Registry::first() {
+  return get(_first);
+}
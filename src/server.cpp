@@ -15,62 +15,395 @@
 
 #include "BufferedAsyncSerial.h"
 #include "zmqclient.hpp"
+#include "hotplug.hpp"
+#include "capture.hpp"
+#include "devicecache.hpp"
 
 #include <iostream>
 #include <chrono>
 #include <filesystem>
+#include <algorithm>
+#include <cerrno>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/log/trivial.hpp>
 
-// so we don't hammer the CPU, we sleep a little while each loop.
-#define SLEEP_TIME            20
-
 using namespace std;
 using njson = nlohmann::json;
 namespace fs = std::filesystem;
 using namespace boost::posix_time;
 
-Server::Server(zmq::socket_t *pull, zmq::socket_t *push, int req, int cadence, int baudrate) : 
-    _pull(pull), _push(push), _cadence(cadence), _baudrate(baudrate) {
+Server::Server(zmq::socket_t *pull, zmq::socket_t *push, int req, const ServerOptions &options) : 
+    _pull(pull), _push(push), _msgs(new MsgPool()), _options(options), _handshakes(0), _burstcount(0), _started(false), _stopping(0),
+    _batching(false), _batchlatency(options.batchlatency), _batchsize(options.batchsize), _batch(0),
+    _statsevery(options.statsevery), _laststats(chrono::steady_clock::now()),
+    _lastlatency(_laststats), _blockedpriority(0) {
 
-	_zmq = zmqClientPtr(new ZMQClient(this, req));
+	_zmq = zmqClientPtr(new ZMQClient(this, req, _options));
+	
+  // run all the serial ports on a shared pool of threads rather than a 
+  // thread each.
+  if (_options.iothreads >= 0) {
+    _pool.reset(new SerialIoPool(_options.iothreads));
+    BOOST_LOG_TRIVIAL(info) << "sharing " << _pool->size() << " io threads";
+  }
+  
+  if (!_options.capture.empty()) {
+    try {
+      _capture.reset(new Capture(_options.capture));
+    }
+    catch (boost::system::system_error& e) {
+      BOOST_LOG_TRIVIAL(error) << "capture error: " << e.what();
+    }
+  }
+  
+  if (!_options.devicecache.empty()) {
+    _cache.reset(new DeviceCache(_options.devicecache));
+  }
 	
 }
 
 Server::~Server() {
+  if (_batch) {
+    _msgs->put(_batch);
+  }
   for (auto i : _connections) {
     i->close();
-    delete i;
   }
   _connections.clear();
 }
 
 void Server::sendjson(const njson &m) {
 
-  BOOST_LOG_TRIVIAL(trace) << "send " << m;
+  // anything already received goes first.
+  flushbatch();
+
+  // serialize straight into a pooled buffer rather than a new string.
+  MsgBuf *buf = _msgs->get();
+  buf->stream() << m;
+  send(buf);
+  
+}
+
+void Server::send(MsgBuf *buf) {
+
+  BOOST_LOG_TRIVIAL(trace) << "send " << buf->_data;
+  
+  if (_capture) {
+    _capture->record(Capture::ZMQOUT, "", buf->data(), buf->size());
+  }
+
+  // ZMQ sends the buffer as it is and gives it back to the pool after, 
+  // even if it couldn't be sent.
+  zmq::message_t zmsg = _msgs->message(buf);
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+  bool sent = _push->send(zmsg, ZMQ_DONTWAIT);
+#else
+  bool sent = (bool)_push->send(zmsg, zmq::send_flags::dontwait);
+#endif
+  if (sent) {
+    _zmqstats.pushed.add();
+  }
+  else {
+    BOOST_LOG_TRIVIAL(debug) << "dropped, nobody to send to";
+    _zmqstats.dropped.add();
+  }
+
+}
+
+void Server::sendframe(const string &header, MsgBuf *frame) {
 
-  string msg = m.dump();
-  zmq::message_t zmsg(msg.length());
-  memcpy(zmsg.data(), msg.c_str(), msg.length());
+  flushbatch();
+  
+  BOOST_LOG_TRIVIAL(trace) << "send " << header << " + " << frame->size() << " bytes";
+  
+  if (_capture) {
+    _capture->record(Capture::ZMQOUT, "", header.data(), header.size());
+    _capture->record(Capture::ZMQOUT, "", frame->data(), frame->size());
+  }
+  
+  // the header and the frame are 2 parts of one message, so they arrive 
+  // together or not at all.
+  MsgBuf *buf = _msgs->get();
+  buf->append(header);
+  zmq::message_t hmsg = _msgs->message(buf);
+  zmq::message_t fmsg = _msgs->message(frame);
 #if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
-  _push->send(zmsg, ZMQ_DONTWAIT);
+  if (_push->send(hmsg, ZMQ_SNDMORE | ZMQ_DONTWAIT)) {
+    _push->send(fmsg, ZMQ_DONTWAIT);
 #else
-  _push->send(zmsg, zmq::send_flags::dontwait);
+  if (_push->send(hmsg, zmq::send_flags::sndmore | zmq::send_flags::dontwait)) {
+    _push->send(fmsg, zmq::send_flags::dontwait);
 #endif
+    _zmqstats.pushed.add();
+  }
+  else {
+    _zmqstats.dropped.add();
+  }
+
+}
+
+void Server::send(const string &msg) {
+
+  flushbatch();
+
+  MsgBuf *buf = _msgs->get();
+  buf->append(msg);
+  send(buf);
+  
+}
+
+void Server::received(const string &prefix, const string &line) {
+
+  // this is the most common message, so only the data needs escaping.
+  if (!_batching) {
+    MsgBuf *buf = _msgs->get();
+    buf->append("{\"received\":");
+    buf->append(prefix);
+    buf->appendescaped(line);
+    buf->append("\"}}");
+    send(buf);
+    return;
+  }
+  
+  if (_batch) {
+    _batch->append(',');
+  }
+  else {
+    _batch = _msgs->get();
+    _batch->append("{\"received\":[");
+    _batchstart = chrono::steady_clock::now();
+  }
+  _batch->append(prefix);
+  _batch->appendescaped(line);
+  _batch->append("\"}");
+  
+  if (_batch->size() >= _batchsize) {
+    flushbatch();
+  }
+  
+}
+
+void Server::flushbatch() {
+
+  if (!_batch) {
+    return;
+  }
+  _batch->append("]}");
+  MsgBuf *buf = _batch;
+  _batch = 0;
+  send(buf);
+  
+}
+
+long Server::batchwait() {
+
+  // how long until the batch must go, -1 if there isn't one.
+  if (!_batch) {
+    return -1;
+  }
+  long left = _batchlatency - 
+    chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - _batchstart).count();
+  return left < 0 ? 0 : left;
+  
+}
+
+long Server::statswait() {
+
+  if (_statsevery <= 0) {
+    return -1;
+  }
+  long left = _statsevery - 
+    chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - _laststats).count();
+  return left < 0 ? 0 : left;
+  
+}
+
+static njson histogram(const Histogram &h) {
+
+  njson j;
+  j["count"] = h.count();
+  j["p50"] = h.percentile(0.5);
+  j["p99"] = h.percentile(0.99);
+  j["p999"] = h.percentile(0.999);
+  j["max"] = h.max();
+  return j;
+  
+}
+
+long Server::latencywait() {
+
+  if (_options.latencylog <= 0) {
+    return -1;
+  }
+  long left = _options.latencylog - 
+    chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - _lastlatency).count();
+  return left < 0 ? 0 : left;
+  
+}
+
+void Server::loglatency() {
 
+  for (auto i: _connections) {
+    if (i->_latency.serial.count() == 0 && i->_latency.dispatch.count() == 0) {
+      continue;
+    }
+    stringstream ss;
+    ss << i->_path << " in: serial ";
+    i->_latency.serial.describe(ss);
+    ss << ", zmq ";
+    i->_latency.zmq.describe(ss);
+    ss << " out: dispatch ";
+    i->_latency.dispatch.describe(ss);
+    ss << ", write ";
+    i->_latency.write.describe(ss);
+    if (i->_latency.priority.count() > 0) {
+      ss << ", priority ";
+      i->_latency.priority.describe(ss);
+    }
+    BOOST_LOG_TRIVIAL(info) << ss.str();
+  }
+  
+}
+
+void Server::sendstats() {
+
+  njson devices = njson::array();
+  for (auto i: _connections) {
+    njson dev;
+    dev["device"] = i->_path;
+    if (i->id()) {
+      dev["id"] = *i->id();
+    }
+    dev["bytesin"] = i->bytesin();
+    dev["linesin"] = i->_stats.linesin.get();
+    dev["framesin"] = i->_stats.framesin.get();
+    dev["bytesout"] = i->_stats.bytesout.get();
+    dev["linesout"] = i->_stats.linesout.get();
+    dev["dropped"] = i->_stats.dropped.get();
+    dev["readqueue"] = i->_backlog;
+    dev["maxreadqueue"] = i->_maxbacklog;
+    dev["overflows"] = i->overflows();
+    dev["discarded"] = i->_stats.discarded.get();
+    dev["writequeue"] = i->writequeue();
+    dev["writes"] = i->writes();
+    dev["busy"] = i->_stats.busy.get();
+    dev["credit"] = i->credit();
+    dev["acks"] = i->_stats.acks.get();
+    dev["handshake"] = i->_stats.handshake.get();
+    dev["reconnects"] = i->_stats.reconnects;
+    njson latency;
+    latency["serial"] = histogram(i->_latency.serial);
+    latency["zmq"] = histogram(i->_latency.zmq);
+    latency["dispatch"] = histogram(i->_latency.dispatch);
+    latency["write"] = histogram(i->_latency.write);
+    latency["priority"] = histogram(i->_latency.priority);
+    dev["latency"] = latency;
+    devices.push_back(dev);
+  }
+  
+  njson stream;
+  stream["sent"] = _zmq->_stats.sent.get();
+  stream["resent"] = _zmq->_stats.resent.get();
+  stream["acked"] = _zmq->_stats.acked.get();
+  stream["errors"] = _zmq->_stats.errors.get();
+  stream["timedout"] = _zmq->_stats.timedout.get();
+  stream["dropped"] = _zmq->_stats.dropped.get();
+  stream["inflight"] = _zmq->inflight();
+  stream["queued"] = _zmq->queued();
+  
+  njson zmq;
+  zmq["pulled"] = _zmqstats.pulled.get();
+  zmq["pushed"] = _zmqstats.pushed.get();
+  zmq["dropped"] = _zmqstats.dropped.get();
+  zmq["stream"] = stream;
+  
+  njson stats;
+  stats["devices"] = devices;
+  stats["waiting"] = _waiting.size();
+  stats["zmq"] = zmq;
+  njson msg;
+  msg["stats"] = stats;
+  sendjson(msg);
+  
+}
+
+void Server::setbatch(const njson &batch) {
+
+  // "batch": true uses what we were started with, or it can have its own
+  // "latency" and "size".
+  flushbatch();
+  _batching = false;
+  _batchlatency = _options.batchlatency;
+  _batchsize = _options.batchsize;
+  if (batch.is_boolean()) {
+    _batching = batch.get<bool>();
+  }
+  else if (batch.is_object()) {
+    _batching = true;
+    auto latency = batch.find("latency");
+    if (latency != batch.end() && latency->is_number()) {
+      _batchlatency = latency->get<int>();
+    }
+    auto size = batch.find("size");
+    if (size != batch.end() && size->is_number()) {
+      _batchsize = size->get<size_t>();
+    }
+  }
+  if (_batching) {
+    BOOST_LOG_TRIVIAL(info) << "batching received lines for " << _batchlatency << "ms or " << _batchsize << " bytes";
+  }
+  
 }
 
-void Server::connect(const string &path, int baud) {
+bool Server::connect(const string &path, int baud) {
 
+  // a board that has been seen before is opened the way it was last time.
+  boost::optional<string> key;
+  boost::optional<CachedDevice> cached;
+  if (_cache) {
+    key = DeviceCache::usbkey(_options.sysfsroot, path);
+    if (key) {
+      cached = _cache->get(*key);
+      if (cached) {
+        BOOST_LOG_TRIVIAL(debug) << path << " is " << *key << ", last seen as " << cached->id;
+        baud = cached->baud;
+      }
+    }
+  }
+
+  // opening resets the arduino, so only bring up so many at a time and let
+  // the rest wait their turn. One from the cache isn't asked for its ID, so
+  // it goes straight away.
+  if (!cached && _options.maxhandshakes > 0 && _handshakes >= _options.maxhandshakes) {
+    BOOST_LOG_TRIVIAL(debug) << path << " waiting to connect";
+    _waiting.push_back(path);
+    return true;
+  }
+  
   BOOST_LOG_TRIVIAL(info) << "connecting to " << path;
 
   BufferedAsyncSerial *serial = 0;
   try {
-    serial = new BufferedAsyncSerial(path, baud);
+    serial = _pool ? new BufferedAsyncSerial(_pool.get()) : new BufferedAsyncSerial();
+    
+    // the capture has to be in place before anything is read.
+    if (_capture) {
+      Capture *capture = _capture.get();
+      serial->setCaptureCallback([capture, path](bool sent, const char *data, size_t len) {
+        capture->record(sent ? Capture::SERIALOUT : Capture::SERIALIN, path, data, len);
+      });
+    }
+    
+    // and so does everything else, a line can arrive as soon as it's open.
+    setupserial(serial);
+    serial->open(path, baud);
   }
   catch (boost::system::system_error& e) {
     BOOST_LOG_TRIVIAL(error) << "open error: " << e.what();
-    return;
+    if (serial) {
+      delete serial;
+    }
+    return false;
   }
   
   if (!serial || !serial->isOpen() || serial->errorStatus()) {
@@ -80,65 +413,211 @@ void Server::connect(const string &path, int baud) {
     njson msg;
     msg["error"] = "couldn't open port";
     sendjson(msg);
-    return;
+    return false;
   }
   
-  {
-    njson msg;
-    msg["device"] = path;
-    sendjson(msg);
+  // store it.
+  Connection *conn = _connections.add(path, serial);
+  conn->_stats.reconnects = _connects[path]++;
+  conn->_baud = baud;
+  if (key) {
+    conn->_usbkey = *key;
   }
   
-  // store it.
-  _connections.push_back(new Connection(path, serial));
+  // no need to wait for the handshake to say who it is, that's checked
+  // while it runs.
+  if (cached) {
+    conn->assumeid(cached->id, _options);
+    _connections.identified(conn);
+  }
+  conn->added(this);
+  
+  // time how long it takes to bring up everything that arrives together.
+  if (_burstcount == 0 && _started) {
+    _burststart = chrono::steady_clock::now();
+  }
+  _burstcount++;
+  
+  // a sketch that acks what it reads is never sent more than it has room for.
+  conn->setcredit(_options.credit);
+  
+  // opening the port resets the arduino, so the handshake lets it settle 
+  // before asking for the ID. The server loop drives it from here.
+  if (!cached) {
+    conn->starthandshake(_options);
+    _handshakes++;
+  }
   
-  // this is a terrible hack but for some reason the first send doesn't TAKE
-  // so we need to wait a bit and send it again.
-  // works just fine after that.
-  boost::this_thread::sleep_for(boost::chrono::milliseconds(500));
-  serial->writeString("ID\n");
-  boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
-  serial->clear();
-  boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
-  serial->writeString("ID\n");
+  // a line that arrived before it was stored was never looked at.
+  _wakeup.signal();
+  return true;
   
 }
 
-Connection *Server::find(const std::string &name) {
+void Server::setupserial(BufferedAsyncSerial *serial) {
+
+  // wake the server loop up whenever a line arrives. 
+  serial->setLineCallback(std::bind(&Wakeup::signal, &_wakeup));
+  
+  // sends wait in the device's write queue, up to a point. Whatever is 
+  // waiting for room is woken when it empties.
+  serial->setWriteLimit(_options.writequeuebytes, _options.writequeuewrites, _options.writepolicy == "dropoldest");
+  serial->setDrainedCallback(std::bind(&Wakeup::signal, &_wakeup));
+  
+  // and lines from it wait in the read queue, up to a point. Reading stops
+  // while it's full, so a device that sends faster than we can keep up 
+  // just has to wait.
+  BufferedAsyncSerial::FlowSignal signal = BufferedAsyncSerial::none;
+  if (_options.readflow == "xoff") {
+    signal = BufferedAsyncSerial::software;
+  }
+  else if (_options.readflow == "rts") {
+    signal = BufferedAsyncSerial::hardware;
+  }
+  serial->setReadLimit(_options.readqueuehigh, _options.readqueuelow, signal);
+  
+}
+
+bool Server::iswaiting(const string &path) {
+  return std::find(_waiting.begin(), _waiting.end(), path) != _waiting.end();
+}
+
+long Server::handshake() {
+
+  // start any devices that are waiting for a turn.
+  while (!_waiting.empty() && (_options.maxhandshakes <= 0 || _handshakes < _options.maxhandshakes)) {
+    string path = _waiting.front();
+    _waiting.pop_front();
+    reopen(path);
+  }
+  
+  // move any handshakes along that are due and work out how long until
+  // the next one needs us.
+  auto now = chrono::steady_clock::now();
+  long wait = -1;
+  int busy = 0;
+  vector<Connection *> stale;
   for (auto i : _connections) {
-    if (i->matchid(name)) {
-      return i;
+    bool was = i->handshaking();
+    boost::optional<chrono::steady_clock::time_point> deadline = i->handshake(_options, now);
+    if (was && !i->handshaking()) {
+      // it gave up without an ID.
+      _handshakes--;
+    }
+    if (i->stale()) {
+      stale.push_back(i);
+    }
+    if (deadline) {
+      // checking a cached ID doesn't hold up the rest.
+      if (i->handshaking()) {
+        busy++;
+      }
+      long ms = chrono::duration_cast<chrono::milliseconds>(*deadline - now).count() + 1;
+      if (wait < 0 || ms < wait) {
+        wait = ms;
+      }
     }
   }
-  return 0;
+  
+  // a board that isn't what the cache said is forgotten and started again
+  // from the beginning.
+  for (auto i : stale) {
+    string path = i->_path;
+    if (_cache && !i->_usbkey.empty()) {
+      _cache->forget(i->_usbkey);
+    }
+    remove(path);
+    reopen(path);
+  }
+  
+  if (busy == 0 && _waiting.empty() && (_burstcount > 0 || !_started)) {
+    long ms = chrono::duration_cast<chrono::milliseconds>(now - _burststart).count();
+    BOOST_LOG_TRIVIAL(info) << (_started ? "brought up " : "startup: ") << _burstcount << " devices in " << ms << "ms";
+    _burstcount = 0;
+    _started = true;
+  }
+  return wait;
+  
+}
+
+Connection *Server::find(const std::string &name) {
+  return _connections.findid(name);
 }
 
 Connection *Server::finddevice(const std::string &device) {
-  for (auto i : _connections) {
-    if (i->matchpath(device)) {
-      return i;
-    }
+  return _connections.findpath(device);
+}
+
+Connection *Server::get(const ConnectionHandle &handle) {
+  return _connections.get(handle);
+}
+
+void Server::identified(Connection *conn) {
+
+  // it's no longer holding up the ones waiting for a turn.
+  _handshakes--;
+  _connections.identified(conn);
+  
+  if (_cache && !conn->_usbkey.empty() && conn->id()) {
+    _cache->put(conn->_usbkey, { *conn->id(), conn->_baud });
   }
-  return 0;
+  
 }
 
-void Server::sendserial(Connection *conn, const std::string &data) {
+void Server::sendserial(Connection *conn, const std::string &data, int priority) {
 
   BOOST_LOG_TRIVIAL(info) << "sending to " << conn->_path;
 
   if (!conn->isgood()) {
     BOOST_LOG_TRIVIAL(error) << "error while sending";
+    conn->_stats.dropped.add();
     njson msg;
     msg["error"] = "couldnt send";
     sendjson(msg);
     return;
   }
   
-  conn->write(data);
+  if (!conn->write(data, priority)) {
+    if (_options.writepolicy == "block") {
+      BOOST_LOG_TRIVIAL(debug) << conn->_path << " is full, waiting";
+      _blocked = conn->_handle;
+      _blockeddata = data;
+      _blockedpriority = priority;
+      return;
+    }
+    BOOST_LOG_TRIVIAL(debug) << conn->_path << " is full, refused";
+    njson msg;
+    msg["error"] = "busy";
+    msg["device"] = conn->_path;
+    msg["writequeue"] = conn->writequeue();
+    msg["writes"] = conn->writes();
+    sendjson(msg);
+    return;
+  }
+  conn->_latency.dispatch.record(chrono::steady_clock::now() - _pulled);
   
-  njson msg;
-  msg["sent"] = conn->_path;
-  sendjson(msg);
+  conn->sent(this);
+  
+}
+
+bool Server::unblock() {
+
+  if (!_blocked) {
+    return true;
+  }
+  
+  // the device may have gone while it waited.
+  Connection *conn = get(*_blocked);
+  if (conn && conn->isgood()) {
+    if (!conn->write(_blockeddata, _blockedpriority)) {
+      return false;
+    }
+    conn->_latency.dispatch.record(chrono::steady_clock::now() - _pulled);
+    conn->sent(this);
+  }
+  _blocked = boost::none;
+  _blockeddata.clear();
+  return true;
   
 }
 
@@ -173,49 +652,68 @@ boost::optional<njson::iterator> Server::get(njson *json, const string &name) {
   
 }
 
+bool Server::isdevice(const string &path) {
+
+  string f = fs::path(path).filename().string();
+#ifdef __APPLE__
+  return f.find("cu.usb") == 0;
+#else
+  return f.find("ttyUSB") == 0 || f.find("ttyAC") == 0;
+#endif
+
+}
+
 void Server::getdevs(vector<string> *devs) {
 
   devs->clear();
   fs::directory_iterator end_iter;
-  for (fs::directory_iterator i("/dev"); i != end_iter; i++) {
+  for (fs::directory_iterator i(_options.devdir); i != end_iter; i++) {
     string f = i->path().string();
-  #ifdef __APPLE__
-    if (f.find("/dev/cu.usb") != string::npos) {
-  #else
-    if (f.find("/dev/ttyUSB") != string::npos || f.find("/dev/ttyAC") != string::npos) {
-  #endif
+    if (isdevice(f)) {
       devs->push_back(f);
     }
   }
   
+  // set_difference needs these sorted.
+  sort(devs->begin(), devs->end());
+  
 }
 
 void Server::opendevs(const vector<string> &devs) {
 
   for (auto i : devs) {
-    connect(i, _baudrate);
+    connect(i, _options.baudrate);
   }
 
 }
 
 void Server::remove(const string &path) {
-  for (vector<Connection *>::iterator i=_connections.begin(); i != _connections.end(); i++) {
-    if ((*i)->matchpath(path)) {
-      BOOST_LOG_TRIVIAL(info) << "removed ";
-      stringstream ss;
-      (*i)->describe(ss);
-      BOOST_LOG_TRIVIAL(info) << ss.str();
-      njson msg;
-      msg["removed"] = path;
-      sendjson(msg);
-      (*i)->destroy();
-      delete *i;
-      _connections.erase(i);
-      return;
+  _waiting.erase(std::remove(_waiting.begin(), _waiting.end(), path), _waiting.end());
+  Connection *conn = _connections.findpath(path);
+  if (conn) {
+    if (conn->handshaking()) {
+      _handshakes--;
     }
+    BOOST_LOG_TRIVIAL(info) << "removed ";
+    stringstream ss;
+    conn->describe(ss);
+    BOOST_LOG_TRIVIAL(info) << ss.str();
+    conn->removed(this);
+    conn->destroy();
+    _connections.remove(conn);
   }
 }
 
+void Server::reopen(const string &path) {
+
+  // with hotplug it's only one of ours once it opens, so that it's tried
+  // again when its attributes change.
+  if (!connect(path, _options.baudrate) && _hotplug) {
+    _curdevs.erase(std::remove(_curdevs.begin(), _curdevs.end(), path), _curdevs.end());
+  }
+  
+}
+
 void Server::handladdremove() {
 
   vector<string> devs;
@@ -238,25 +736,142 @@ void Server::handladdremove() {
   
 }
 
-void Server::start() {
+void Server::handlehotplug() {
+
+  vector<Hotplug::Event> events;
+  if (!_hotplug->read(&events)) {
+    BOOST_LOG_TRIVIAL(warning) << "lost hotplug events, rescanning";
+    handladdremove();
+    return;
+  }
+  
+  // in the order they happened, so a board that is unplugged and plugged
+  // back in between reads is opened again.
+  for (auto i: events) {
+    if (!isdevice(i.path)) {
+      continue;
+    }
+    if (i.change == Hotplug::removed) {
+      remove(i.path);
+      _curdevs.erase(std::remove(_curdevs.begin(), _curdevs.end(), i.path), _curdevs.end());
+      continue;
+    }
+    
+    // udev creates the device and then sets its permissions, so if we
+    // couldn't open it when it was added, try again when they change. It's
+    // only one of ours once it opens.
+    if (std::find(_curdevs.begin(), _curdevs.end(), i.path) == _curdevs.end() && connect(i.path, _options.baudrate)) {
+      _curdevs.insert(upper_bound(_curdevs.begin(), _curdevs.end(), i.path), i.path);
+    }
+  }
   
-  _zmq->run();
+}
 
+void Server::stop() {
+  _stopping = 1;
+  _wakeup.signal();
+}
+
+void Server::start() {
+  
+  // watch for devices before the first scan so we don't miss any.
+  if (_options.hotplug) {
+    _hotplug.reset(new Hotplug(_options.devdir));
+    if (_hotplug->fd() < 0) {
+      _hotplug.reset();
+    }
+  }
+  if (_hotplug) {
+    BOOST_LOG_TRIVIAL(info) << "watching " << _options.devdir << " for devices";
+  }
+  else {
+    BOOST_LOG_TRIVIAL(info) << "scanning " << _options.devdir << " for devices every " << _options.cadence << "ms";
+  }
+  
+  // all the devices we find now are brought up together.
+  _burststart = chrono::steady_clock::now();
   getdevs(&_curdevs);
   opendevs(_curdevs);
   
-  ptime start = second_clock::local_time();
+  ptime start = microsec_clock::local_time();
 
-  while (1) {
+  zmq::pollitem_t items [] = {
+      { *_pull, 0, ZMQ_POLLIN, 0 },
+      { 0, _wakeup.fd(), ZMQ_POLLIN, 0 },
+      { _zmq->socket(), 0, ZMQ_POLLIN, 0 },
+      { 0, _hotplug ? _hotplug->fd() : -1, ZMQ_POLLIN, 0 }
+  };
+  
+  while (!_stopping) {
 
-//    cout << "." << endl;
-      
+    // sleep until there is a message, a line from a device, a device is 
+    // added or removed, a handshake needs attention or it's time to check 
+    // the device tree.
+    long wait = handshake();
+    if (!_hotplug) {
+      long scan = _options.cadence - (microsec_clock::local_time() - start).total_milliseconds();
+      if (scan < 0) {
+        scan = 0;
+      }
+      if (wait < 0 || scan < wait) {
+        wait = scan;
+      }
+    }
+    long stream = _zmq->check();
+    if (stream >= 0 && (wait < 0 || stream < wait)) {
+      wait = stream;
+    }
+    long batch = batchwait();
+    if (batch >= 0 && (wait < 0 || batch < wait)) {
+      wait = batch;
+    }
+    long stats = statswait();
+    if (stats >= 0 && (wait < 0 || stats < wait)) {
+      wait = stats;
+    }
+    long latency = latencywait();
+    if (latency >= 0 && (wait < 0 || latency < wait)) {
+      wait = latency;
+    }
+    // a blocked send holds up everything behind it on the socket, and the
+    // client's own high water mark pushes back from there.
+    items[0].events = _blocked ? 0 : ZMQ_POLLIN;
+    try {
+      zmq::poll(items, _hotplug ? 4 : 3, std::chrono::milliseconds(wait));
+    }
+    catch (zmq::error_t &e) {
+      // interrupted by a signal, which may have been to stop.
+      if (e.num() != EINTR) {
+        throw;
+      }
+      continue;
+    }
+    
+    if (items[1].revents & ZMQ_POLLIN) {
+      // drain first so a line arriving while we read wakes us up again.
+      _wakeup.drain();
+    }
+    
+    if (items[2].revents & ZMQ_POLLIN) {
+      _zmq->receive();
+    }
+    
+    if (_hotplug && (items[3].revents & ZMQ_POLLIN)) {
+      handlehotplug();
+    }
+    
+    // handle every message that is waiting.
     zmq::message_t reply;
 #if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
-    if (_pull->recv(&reply, ZMQ_DONTWAIT)) {
+    while (unblock() && _pull->recv(&reply, ZMQ_DONTWAIT)) {
 #else
-    if (_pull->recv(reply, zmq::recv_flags::dontwait)) {
+    while (unblock() && _pull->recv(reply, zmq::recv_flags::dontwait)) {
 #endif
+      _zmqstats.pulled.add();
+      _pulled = chrono::steady_clock::now();
+      if (_capture) {
+        _capture->record(Capture::ZMQIN, "", (const char *)reply.data(), reply.size());
+      }
       string s((const char *)reply.data(), reply.size());
       njson doc = njson::parse(s);
       {
@@ -265,12 +880,29 @@ void Server::start() {
         if (connected) {
           string name = **connected;
           BOOST_LOG_TRIVIAL(info) << name << " connected";
+          boost::optional<njson::iterator> batch = get(&doc, "batch");
+          setbatch(batch ? **batch : njson(false));
           for (auto i: _connections) {
             i->added(this);
           }
           continue;
         }
       }
+      {
+        // a client wants to know how we are doing, now or every so often.
+        boost::optional<njson::iterator> stats = get(&doc, "stats");
+        if (stats) {
+          if ((*stats)->is_object()) {
+            boost::optional<int> every = getint(*stats, "every");
+            if (every) {
+              _statsevery = *every;
+              _laststats = chrono::steady_clock::now();
+            }
+          }
+          sendstats();
+          continue;
+        }
+      }
       {
         // we know the stream to use
         boost::optional<njson::iterator> stream = get(&doc, "stream");
@@ -305,6 +937,90 @@ void Server::start() {
           continue;
         }
       }
+      {
+        // a client wants binary frames from a device.
+        boost::optional<njson::iterator> j = get(&doc, "raw");
+        if (j) {
+          Connection *conn = 0;
+          boost::optional<string> id = getstring(*j, "id");
+          if (id) {
+            conn = find(*id);
+          }
+          else {
+            boost::optional<string> device = getstring(*j, "device");
+            if (device) {
+              conn = finddevice(*device);
+            }
+          }
+          if (!conn) {
+            njson msg;
+            msg["error"] = "not connected ";
+            sendjson(msg);
+            continue;
+          }
+          boost::optional<string> framing = getstring(*j, "framing");
+          Connection::Framing f;
+          if (!framing || *framing == "cobs") {
+            f = Connection::COBS;
+          }
+          else if (*framing == "length") {
+            f = Connection::LENGTH;
+          }
+          else if (*framing == "lines") {
+            f = Connection::LINES;
+          }
+          else {
+            njson msg;
+            msg["error"] = "unknown framing";
+            sendjson(msg);
+            continue;
+          }
+          BOOST_LOG_TRIVIAL(info) << conn->_path << " framing " << (framing ? *framing : "cobs");
+          if (!conn->setframing(f, std::bind(&Wakeup::signal, &_wakeup))) {
+            njson msg;
+            msg["error"] = "credit needs lines";
+            sendjson(msg);
+          }
+          continue;
+        }
+      }
+      {
+        // a client knows a device acks what it reads, or that it doesn't.
+        boost::optional<njson::iterator> j = get(&doc, "credit");
+        if (j) {
+          Connection *conn = 0;
+          boost::optional<string> id = getstring(*j, "id");
+          if (id) {
+            conn = find(*id);
+          }
+          else {
+            boost::optional<string> device = getstring(*j, "device");
+            if (device) {
+              conn = finddevice(*device);
+            }
+          }
+          if (!conn) {
+            njson msg;
+            msg["error"] = "not connected ";
+            sendjson(msg);
+            continue;
+          }
+          boost::optional<int> window = getint(*j, "window");
+          if (!window || *window < 0) {
+            njson msg;
+            msg["error"] = "missing window";
+            sendjson(msg);
+            continue;
+          }
+          BOOST_LOG_TRIVIAL(info) << conn->_path << " credit " << *window;
+          if (!conn->setcredit(*window)) {
+            njson msg;
+            msg["error"] = "credit needs lines";
+            sendjson(msg);
+          }
+          continue;
+        }
+      }
       {
         // a client want's to send data.
         boost::optional<njson::iterator> j = get(&doc, "send");
@@ -326,7 +1042,7 @@ void Server::start() {
             }
             else {
               if (_connections.size() > 0) {
-                conn = _connections[0];
+                conn = _connections.first();
               }
               else {
                 njson msg;
@@ -342,26 +1058,47 @@ void Server::start() {
             sendjson(msg);
             continue;
           }         
+          // a send with a priority goes ahead of everything less important
+          // that is waiting for the device.
+          boost::optional<int> priority = getint(*j, "priority");
           BOOST_LOG_TRIVIAL(info) << "sending: " << *data; 
-          sendserial(conn, *data);
+          sendserial(conn, *data, priority ? max(*priority, 0) : 0);
         }
       }
     }
 
-    boost::this_thread::sleep_for(boost::chrono::milliseconds(SLEEP_TIME));
-
+    // a device may have more lines queued than its budget, so come 
+    // straight back for them.
     for (auto i : _connections) {
-      i->doread(this);
+      if (i->doread(this, _options.readbudget)) {
+        _wakeup.signal();
+      }
+      i->checkdrained(this);
+    }
+    if (batchwait() == 0) {
+      flushbatch();
+    }
+    if (statswait() == 0) {
+      _laststats = chrono::steady_clock::now();
+      sendstats();
+    }
+    if (latencywait() == 0) {
+      _lastlatency = chrono::steady_clock::now();
+      loglatency();
     }
 
     // every so often, check the device tree.
-    ptime cur = microsec_clock::local_time();
-    time_duration diff = cur - start;
-    if (diff.total_milliseconds() > _cadence) {
-      handladdremove();
-      start = cur;
+    if (!_hotplug) {
+      ptime cur = microsec_clock::local_time();
+      time_duration diff = cur - start;
+      if (diff.total_milliseconds() > _options.cadence) {
+        handladdremove();
+        start = cur;
+      }
     }
     
   }
+  
+  flushbatch();
 
 }
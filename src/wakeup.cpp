@@ -0,0 +1,50 @@
+/*
+  wakeup.cpp
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#include "wakeup.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <boost/system/system_error.hpp>
+
+Wakeup::Wakeup() {
+
+  // a pipe works everywhere (eventfd is Linux only), and both ends are
+  // non blocking so a signal never stalls a reader thread.
+  if (pipe(_fds) < 0) {
+    throw boost::system::system_error(errno, boost::system::system_category(), "wakeup pipe");
+  }
+  for (int i=0; i<2; i++) {
+    fcntl(_fds[i], F_SETFL, fcntl(_fds[i], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  
+}
+
+Wakeup::~Wakeup() {
+  close(_fds[0]);
+  close(_fds[1]);
+}
+
+void Wakeup::signal() {
+
+  // if the pipe is full there is already a wakeup pending.
+  char c = 1;
+  ssize_t n = write(_fds[1], &c, 1);
+  (void)n;
+  
+}
+
+void Wakeup::drain() {
+
+  char buf[64];
+  while (read(_fds[0], buf, sizeof(buf)) > 0);
+  
+}
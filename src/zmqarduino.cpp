@@ -28,6 +28,17 @@ namespace po = boost::program_options;
 
 using namespace std;
 
+// only one of these, not whatever was typed.
+static std::function<void (const string &)> oneof(const string &name, const vector<string> &values) {
+  return [name, values](const string &value) {
+    if (find(values.begin(), values.end(), value) == values.end()) {
+      po::invalid_option_value e(value);
+      e.set_option_name(name);
+      throw e;
+    }
+  };
+}
+
 int main(int argc, char *argv[]) {
 
   string version = "ZMQArduino 1.1, 21-Jun-2025.";
@@ -35,8 +46,7 @@ int main(int argc, char *argv[]) {
   int pushPort;
   int pullPort;
   int reqPort;
-  int cadence;
-  int baudrate;
+  ServerOptions options;
   string logLevel;
 
   po::options_description desc("Allowed options");
@@ -44,17 +54,51 @@ int main(int argc, char *argv[]) {
     ("pullPort", po::value<int>(&pullPort)->default_value(5558), "ZMQ Pull port.")
     ("pushPort", po::value<int>(&pushPort)->default_value(5559), "ZMQ Push port.")
     ("reqPort", po::value<int>(&reqPort)->default_value(3013), "ZMQ Req port.")
-    ("cadence", po::value<int>(&cadence)->default_value(200), "Device check cadence in milliseconds.")
-    ("baudrate", po::value<int>(&baudrate)->default_value(9600), "Baud rate.")
+    ("cadence", po::value<int>(&options.cadence)->default_value(options.cadence), "Device check cadence in milliseconds.")
+    ("baudrate", po::value<int>(&options.baudrate)->default_value(options.baudrate), "Baud rate.")
+    ("ioThreads", po::value<int>(&options.iothreads)->default_value(options.iothreads), "Share this many serial io threads between all devices (0 for one per core, -1 for a thread per device).")
+    ("readBudget", po::value<int>(&options.readbudget)->default_value(options.readbudget), "Most lines to read from a device before moving on to the next.")
+    ("devDir", po::value<string>(&options.devdir)->default_value(options.devdir), "Directory to look for devices in.")
+    ("hotplug", po::value<bool>(&options.hotplug)->default_value(options.hotplug), "Watch for devices with inotify where possible rather than scanning every cadence.")
+    ("settle", po::value<int>(&options.settle)->default_value(options.settle), "Milliseconds to let a device reset after opening before asking for the ID.")
+    ("idTimeout", po::value<int>(&options.idtimeout)->default_value(options.idtimeout), "Milliseconds to wait for the ID.")
+    ("idRetries", po::value<int>(&options.idretries)->default_value(options.idretries), "Times to ask again for the ID before giving up.")
+    ("idBackoff", po::value<double>(&options.idbackoff)->default_value(options.idbackoff), "The ID timeout is multiplied by this for each retry.")
+    ("maxHandshakes", po::value<int>(&options.maxhandshakes)->default_value(options.maxhandshakes), "Most devices to open and identify at once (0 for no limit).")
+    ("batchLatency", po::value<int>(&options.batchlatency)->default_value(options.batchlatency), "Most milliseconds a received line waits to go out in a batch.")
+    ("batchSize", po::value<int>(&options.batchsize)->default_value(options.batchsize), "Bytes in a batch of received lines before it is sent.")
+    ("streamWindow", po::value<int>(&options.streamwindow)->default_value(options.streamwindow), "Most objects sent to a stream that can be waiting for a reply at once (1 with streamBatch).")
+    ("streamTimeout", po::value<int>(&options.streamtimeout)->default_value(options.streamtimeout), "Milliseconds to wait for a reply to an object before sending it again.")
+    ("streamRetries", po::value<int>(&options.streamretries)->default_value(options.streamretries), "Times to send an object again before giving up.")
+    ("streamBatch", po::value<int>(&options.streambatch)->default_value(options.streambatch), "Most lines sent to a stream in one request (1 for a request each).")
+    ("streamLatency", po::value<int>(&options.streamlatency)->default_value(options.streamlatency), "Most milliseconds a line waits to be sent to a stream with others.")
+    ("statsEvery", po::value<int>(&options.statsevery)->default_value(options.statsevery), "Milliseconds between stats sent to the client (0 for only when asked).")
+    ("latencyLog", po::value<int>(&options.latencylog)->default_value(options.latencylog), "Milliseconds between logging the latencies for each device (0 for never).")
+    ("capture", po::value<string>(&options.capture)->default_value(options.capture), "Capture everything to and from the devices and ZMQ to this file, for zmqarduino_replay.")
+    ("deviceCache", po::value<string>(&options.devicecache)->default_value(options.devicecache), "File to remember the ID of each USB board in, so it's known as soon as it's plugged in.")
+    ("sysfsRoot", po::value<string>(&options.sysfsroot)->default_value(options.sysfsroot), "Where sysfs is, to find the USB serial number of each device.")
+    ("writeQueueBytes", po::value<int>(&options.writequeuebytes)->default_value(options.writequeuebytes), "Most bytes that can be waiting to be written to a device (0 for no limit).")
+    ("writeQueueWrites", po::value<int>(&options.writequeuewrites)->default_value(options.writequeuewrites), "Most sends that can be waiting to be written to a device (0 for no limit).")
+    ("writePolicy", po::value<string>(&options.writepolicy)->default_value(options.writepolicy)->notifier(oneof("writePolicy", { "reject", "dropoldest", "block" })), "When a device's write queue is full [reject, dropoldest, block].")
+    ("readQueueHigh", po::value<int>(&options.readqueuehigh)->default_value(options.readqueuehigh), "Most bytes from a device waiting to be read before reading from it stops (0 for as many as the queue holds).")
+    ("readQueueLow", po::value<int>(&options.readqueuelow)->default_value(options.readqueuelow), "Bytes from a device waiting to be read when reading from it starts again.")
+    ("readFlow", po::value<string>(&options.readflow)->default_value(options.readflow)->notifier(oneof("readFlow", { "none", "xoff", "rts" })), "How a device is told to stop sending while reading from it has stopped [none, xoff, rts].")
+    ("credit", po::value<int>(&options.credit)->default_value(options.credit), "Bytes a device can be sent before it acks them, the size of its serial buffer (0 for no acks).")
     ("logLevel", po::value<string>(&logLevel)->default_value("info"), "Logging level [trace, debug, warn, info].")
     ("help", "produce help message")
     ;
   po::positional_options_description p;
 
   po::variables_map vm;
-  po::store(po::command_line_parser(argc, argv).
-          options(desc).positional(p).run(), vm);
-  po::notify(vm);   
+  try {
+    po::store(po::command_line_parser(argc, argv).
+            options(desc).positional(p).run(), vm);
+    po::notify(vm);   
+  }
+  catch (po::error &e) {
+    cerr << e.what() << endl << endl << desc << endl;
+    return 1;
+  }
 
   if (logLevel == "trace") {
     boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::trace);
@@ -93,7 +137,7 @@ int main(int argc, char *argv[]) {
   push.connect("tcp://127.0.0.1:" + to_string(pushPort));
   BOOST_LOG_TRIVIAL(info) << "Connect to ZMQ as PUSH on " << pushPort;
   
-  Server server(&pull, &push, reqPort, cadence, baudrate);
+  Server server(&pull, &push, reqPort, options);
   server.start();
 
 }
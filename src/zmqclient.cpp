@@ -13,17 +13,25 @@
 
 #include "zmqclient.hpp"
 
+#include "server.hpp"
+
 #include <boost/log/trivial.hpp>
-#include <thread>
 
-ZMQClient::ZMQClient(Server *server, int reqPort) : 
-  _server(server) {
+ZMQClient::ZMQClient(Server *server, int reqPort, const ServerOptions &options) : 
+  _server(server), _nextcorr(1),
+  _window(options.streambatch > 1 || options.streamwindow < 1 ? 1 : options.streamwindow),
+  _timeout(options.streamtimeout), _retries(options.streamretries),
+  _batchsize(options.streambatch > 1 ? options.streambatch : 1), _batchlatency(options.streamlatency) {
 
   _context.reset(new zmq::context_t(1));
 
-  _req.reset(new zmq::socket_t(*_context, ZMQ_REQ));
-  _req->connect("tcp://127.0.0.1:" + to_string(reqPort));
-	BOOST_LOG_TRIVIAL(info) << "Connect to ZMQ as Local REQ on " << reqPort;
+  _dealer.reset(new zmq::socket_t(*_context, ZMQ_DEALER));
+  _dealer->connect("tcp://127.0.0.1:" + to_string(reqPort));
+  if (options.streambatch > 1 && options.streamwindow > 1) {
+    // one sent again would land after the batches behind it.
+    BOOST_LOG_TRIVIAL(info) << "batched lines are sent one request at a time";
+  }
+	BOOST_LOG_TRIVIAL(info) << "Connect to ZMQ as Local DEALER on " << reqPort << " with a window of " << _window;
   
   // expect these as replies
   _reqmessages["ack"] = bind( &ZMQClient::ackMsg, this, placeholders::_1 );
@@ -31,46 +39,28 @@ ZMQClient::ZMQClient(Server *server, int reqPort) :
   
 }
 
-void ZMQClient::run() {
-
-  thread t(bind(&ZMQClient::receive, this));
-  t.detach();
-  
-}
-
 void ZMQClient::receive() {
 
-  BOOST_LOG_TRIVIAL(trace) << "start receiving";
-
-  zmq::pollitem_t items [] = {
-      { *_req, 0, ZMQ_POLLIN, 0 }
-  };
-  const std::chrono::milliseconds timeout{500};
-  while (1) {
-    
-//    BOOST_LOG_TRIVIAL(debug) << "polling for messages";
-    zmq::message_t message;
-    zmq::poll(items, 1, timeout);
-
-//     BOOST_LOG_TRIVIAL(trace) << "sub events " << items[0].revents;
-//     BOOST_LOG_TRIVIAL(trace) << "req events " << items[1].revents;
-
-    if (items[0].revents & ZMQ_POLLIN) {
-      BOOST_LOG_TRIVIAL(trace) << "got _req message";
-      zmq::message_t reply;
-      try {
+  zmq::message_t reply;
+  try {
 #if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
-        _req->recv(&reply);
+    while (_dealer->recv(&reply, ZMQ_DONTWAIT)) {
 #else
-        auto res = _req->recv(reply, zmq::recv_flags::none);
+    while (_dealer->recv(reply, zmq::recv_flags::dontwait)) {
 #endif
-        handle_reply(reply, &_reqmessages, "<-");
-      }
-      catch (zmq::error_t &e) {
-        BOOST_LOG_TRIVIAL(warning) << "got exc with _req recv" << e.what() << "(" << e.num() << ")";
+      // a REP peer puts an empty frame before the reply.
+      if (reply.size() == 0) {
+        continue;
       }
+      BOOST_LOG_TRIVIAL(trace) << "got _dealer message";
+      handle_reply(reply, &_reqmessages, "<-");
     }
   }
+  catch (zmq::error_t &e) {
+    BOOST_LOG_TRIVIAL(warning) << "got exc with _dealer recv" << e.what() << "(" << e.num() << ")";
+  }
+  
+  sendqueued(chrono::steady_clock::now());
 
 }
 
@@ -104,13 +94,21 @@ bool ZMQClient::trySend(const string &m) {
 
   BOOST_LOG_TRIVIAL(trace) << "try sending " << m;
 
+  // an empty frame first, like REQ does, so a REP peer can reply.
+  zmq::message_t delim;
 	zmq::message_t msg(m.length());
 	memcpy(msg.data(), m.c_str(), m.length());
   try {
 #if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
-    _req->send(msg);
+    if (!_dealer->send(delim, ZMQ_SNDMORE | ZMQ_DONTWAIT)) {
+      return false;
+    }
+    _dealer->send(msg, ZMQ_DONTWAIT);
 #else
-    _req->send(msg, zmq::send_flags::none);
+    if (!_dealer->send(delim, zmq::send_flags::sndmore | zmq::send_flags::dontwait)) {
+      return false;
+    }
+    _dealer->send(msg, zmq::send_flags::dontwait);
 #endif
     return true;
   }
@@ -120,26 +118,148 @@ bool ZMQClient::trySend(const string &m) {
 
 }
 
-void ZMQClient::send(const json &j) {
+void ZMQClient::send(const json &j, boost::json::array texts) {
 
-  stringstream ss;
-  ss << j;
-  string m = ss.str();
+  if (_queued.size() >= MAX_QUEUED) {
+    BOOST_LOG_TRIVIAL(warning) << "too many waiting to send, dropping the oldest";
+    _queued.pop_front();
+    _stats.dropped.add();
+  }
+  
+  // the reply can have the correlation id in it.
+  Request r;
+  r.corr = _nextcorr++;
+  r.tries = 0;
+  r.texts = std::move(texts);
+  json body = j;
+  body.as_object()["corr"] = r.corr;
+  r.body = boost::json::serialize(body);
+  _queued.push_back(r);
   
-  if (!trySend(m)) {
-    for (int i=0; i<4; i++) {
-	    this_thread::sleep_for(chrono::milliseconds(20));
-      BOOST_LOG_TRIVIAL(trace) << "retrying send";
-	    if (trySend(m)) {
-	      return;
-	    }
+  sendqueued(chrono::steady_clock::now());
+
+}
+
+void ZMQClient::sendqueued(timepoint now) {
+
+  while (!_queued.empty() && _inflight.size() < _window) {
+    Request &r = _queued.front();
+    if (!trySend(r.body)) {
+      // nobody to send to yet, check will try again.
+      return;
     }
+    _stats.sent.add();
+    r.tries++;
+    r.deadline = now + chrono::milliseconds(_timeout);
+    _inflight[r.corr] = r;
+    _queued.pop_front();
   }
+  
+}
+
+long ZMQClient::check() {
 
+  timepoint now = chrono::steady_clock::now();
+  
+  // lines that have waited long enough go with whatever is with them.
+  for (auto i = _batches.begin(); i != _batches.end(); ) {
+    auto next = std::next(i);
+    if (now - i->second.started >= chrono::milliseconds(_batchlatency)) {
+      flush(i);
+    }
+    i = next;
+  }
+  
+  // send again anything that wasn't replied to in time.
+  for (auto i = _inflight.begin(); i != _inflight.end(); ) {
+    Request &r = i->second;
+    if (now < r.deadline) {
+      i++;
+      continue;
+    }
+    if (r.tries > _retries) {
+      BOOST_LOG_TRIVIAL(error) << "no reply to " << r.corr << " after " << r.tries << " tries";
+      _stats.timedout.add();
+      i = _inflight.erase(i);
+      continue;
+    }
+    BOOST_LOG_TRIVIAL(debug) << "sending " << r.corr << " again";
+    if (trySend(r.body)) {
+      _stats.resent.add();
+      r.tries++;
+    }
+    r.deadline = now + chrono::milliseconds(_timeout);
+    i++;
+  }
+  sendqueued(now);
+  
+  long wait = -1;
+  for (auto i: _inflight) {
+    long left = chrono::duration_cast<chrono::milliseconds>(i.second.deadline - now).count();
+    if (wait < 0 || left < wait) {
+      wait = left < 0 ? 0 : left;
+    }
+  }
+  if (wait < 0 && !_queued.empty()) {
+    // couldn't send, try again later.
+    wait = _timeout;
+  }
+  for (auto &i: _batches) {
+    long left = _batchlatency - chrono::duration_cast<chrono::milliseconds>(now - i.second.started).count();
+    if (wait < 0 || left < wait) {
+      wait = left < 0 ? 0 : left;
+    }
+  }
+  return wait;
+  
+}
+
+bool ZMQClient::take(json *doc, Request *request) {
+
+  // a peer that doesn't give back the id can only be matched when there
+  // is one at a time.
+  uint64_t corr;
+  auto i = _inflight.begin();
+  if (getCorr(doc, &corr)) {
+    i = _inflight.find(corr);
+    if (i == _inflight.end()) {
+      BOOST_LOG_TRIVIAL(debug) << "late reply to " << corr;
+      return false;
+    }
+  }
+  else if (_window > 1) {
+    BOOST_LOG_TRIVIAL(warning) << "reply without corr ignored with a window of " << _window;
+    return false;
+  }
+  if (i == _inflight.end()) {
+    return false;
+  }
+  *request = std::move(i->second);
+  _inflight.erase(i);
+  return true;
+  
 }
 
 void ZMQClient::send(const string &userid, const string &streamid, const string &seqid, const string &text) {
 
+  if (_batchsize > 1) {
+    string key = userid + '\n' + streamid + '\n' + seqid;
+    auto i = _batches.find(key);
+    if (i == _batches.end()) {
+      Batch b;
+      b.user = userid;
+      b.stream = streamid;
+      b.sequence = seqid;
+      b.started = chrono::steady_clock::now();
+      i = _batches.emplace(key, std::move(b)).first;
+    }
+    i->second.texts.emplace_back(text);
+    if (i->second.texts.size() >= _batchsize) {
+      flush(i);
+    }
+    return;
+  }
+  
 	send({ 
 	  { "type", "addobject" }, 
 	  { "objtype", "idea" },
@@ -151,6 +271,24 @@ void ZMQClient::send(const string &userid, const string &streamid, const string
 
 }
 
+void ZMQClient::flush(map<string, Batch>::iterator batch) {
+
+  // the lines stay in the order they came in.
+  Batch &b = batch->second;
+  BOOST_LOG_TRIVIAL(debug) << "sending " << b.texts.size() << " lines to " << b.stream;
+  json j = { 
+	  { "type", "addobjects" }, 
+	  { "objtype", "idea" },
+	  { "me", b.user },
+    { "stream", b.stream },
+	  { "texts", b.texts },
+    { "sequence", b.sequence }
+	};
+  send(j, std::move(b.texts));
+  _batches.erase(batch);
+  
+}
+
 bool ZMQClient::getString(json *j, const string &name, string *value) {
 
   try {
@@ -163,6 +301,30 @@ bool ZMQClient::getString(json *j, const string &name, string *value) {
 
 }
 
+bool ZMQClient::getCorr(json *j, uint64_t *corr) {
+
+  try {
+    *corr = boost::json::value_to<uint64_t>(j->at("corr"));
+    return true;
+  }
+  catch (const boost::system::system_error& ex) {
+    return false;
+  }
+
+}
+
+bool ZMQClient::getIndex(json *j, uint64_t *index) {
+
+  try {
+    *index = boost::json::value_to<uint64_t>(j->at("index"));
+    return true;
+  }
+  catch (const boost::system::system_error& ex) {
+    return false;
+  }
+
+}
+
 bool ZMQClient::getBool(json *j, const string &name, bool *value) {
 
   try {
@@ -177,12 +339,45 @@ bool ZMQClient::getBool(json *j, const string &name, bool *value) {
 
 void ZMQClient::ackMsg(json *doc) {
 
-  BOOST_LOG_TRIVIAL(info) << "acknowleged";
+  _stats.acked.add();
+  Request r;
+  if (!take(doc, &r) || r.texts.empty()) {
+    BOOST_LOG_TRIVIAL(info) << "acknowleged";
+    return;
+  }
+  BOOST_LOG_TRIVIAL(info) << "acknowleged " << r.texts.size() << " lines";
+  
+  // the lines in a bulk request that couldn't be added are given by their
+  // index.
+  boost::json::array *errors = 0;
+  try {
+    errors = doc->at("errors").if_array();
+  }
+  catch (const boost::system::system_error& ex) {
+  }
+  if (!errors) {
+    return;
+  }
+  for (auto &e: *errors) {
+    uint64_t index;
+    string msg;
+    if (!getIndex(&e, &index) || index >= r.texts.size()) {
+      BOOST_LOG_TRIVIAL(error) << "err" << e;
+      continue;
+    }
+    getString(&e, "error", &msg);
+    BOOST_LOG_TRIVIAL(error) << "err " << r.texts[index] << " " << msg;
+  }
 
 }
 
 void ZMQClient::errMsg(json *doc) {
 
   BOOST_LOG_TRIVIAL(error) << "err" << *doc;
+  _stats.errors.add();
+  Request r;
+  if (take(doc, &r) && !r.texts.empty()) {
+    BOOST_LOG_TRIVIAL(error) << r.texts.size() << " lines weren't added";
+  }
 
 }
@@ -0,0 +1,125 @@
+/*
+  testdevicecache.cpp
+
+  Tests for the device cache, with a fake sysfs so no boards are needed.
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#define BOOST_TEST_MODULE devicecache
+#include <boost/test/unit_test.hpp>
+
+#include "devicecache.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <cstdlib>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// a sysfs with USB serial boards in it, and their device nodes.
+struct FakeSysfs {
+
+  FakeSysfs() {
+    char d[] = "/tmp/zmqarduino_testdevicecache.XXXXXX";
+    BOOST_REQUIRE(mkdtemp(d));
+    dir = d;
+    root = dir + "/sys";
+    fs::create_directories(dir + "/dev");
+  }
+  ~FakeSysfs() {
+    fs::remove_all(dir);
+  }
+
+  // the way the ftdi and cdc_acm drivers lay it out, the USB device with
+  // the IDs and the interface the tty is on below it.
+  string add(const string &tty, const string &vid, const string &pid, const string &serial) {
+    fs::path usb = fs::path(root) / "devices" / "usb1" / ("1-" + tty);
+    fs::path intf = usb / ("1-" + tty + ":1.0");
+    fs::create_directories(intf / tty);
+    write(usb / "idVendor", vid);
+    write(usb / "idProduct", pid);
+    if (!serial.empty()) {
+      write(usb / "serial", serial);
+    }
+    fs::path cls = fs::path(root) / "class" / "tty" / tty;
+    fs::create_directories(cls);
+    fs::create_directory_symlink(intf, cls / "device");
+    string node = dir + "/dev/" + tty;
+    write(node, "");
+    return node;
+  }
+
+  void write(const fs::path &path, const string &s) {
+    ofstream f(path);
+    f << s << endl;
+  }
+
+  string dir;
+  string root;
+
+};
+
+BOOST_AUTO_TEST_CASE( usbkey )
+{
+  FakeSysfs sys;
+  string uno = sys.add("ttyACM0", "2341", "0043", "75830333238351F0E1A0");
+  string clone = sys.add("ttyUSB0", "1a86", "7523", "");
+
+  BOOST_CHECK_EQUAL(*DeviceCache::usbkey(sys.root, uno), "2341:0043:75830333238351F0E1A0");
+
+  // a link to the node is the same board.
+  fs::create_symlink(uno, sys.dir + "/dev/by-id");
+  BOOST_CHECK_EQUAL(*DeviceCache::usbkey(sys.root, sys.dir + "/dev/by-id"), "2341:0043:75830333238351F0E1A0");
+
+  // without a serial number it can't be told from another one the same.
+  BOOST_CHECK(!DeviceCache::usbkey(sys.root, clone));
+
+  // and it's not there at all.
+  BOOST_CHECK(!DeviceCache::usbkey(sys.root, sys.dir + "/dev/ttyUSB9"));
+  sys.write(sys.dir + "/dev/ttyS0", "");
+  BOOST_CHECK(!DeviceCache::usbkey(sys.root, sys.dir + "/dev/ttyS0"));
+}
+
+BOOST_AUTO_TEST_CASE( hitMissForget )
+{
+  FakeSysfs sys;
+  string uno = sys.add("ttyACM0", "2341", "0043", "75830333238351F0E1A0");
+  string key = *DeviceCache::usbkey(sys.root, uno);
+  string file = sys.dir + "/cache.json";
+
+  {
+    DeviceCache cache(file);
+    BOOST_CHECK(!cache.get(key));
+    cache.put(key, { "arduino", 115200 });
+  }
+
+  // it's still there the next time.
+  {
+    DeviceCache cache(file);
+    boost::optional<CachedDevice> dev = cache.get(key);
+    BOOST_REQUIRE(dev);
+    BOOST_CHECK_EQUAL(dev->id, "arduino");
+    BOOST_CHECK_EQUAL(dev->baud, 115200);
+    BOOST_CHECK(!cache.get("2341:0043:other"));
+
+    // a board that didn't reply with the same ID is forgotten.
+    cache.forget(key);
+    BOOST_CHECK(!cache.get(key));
+  }
+  {
+    DeviceCache cache(file);
+    BOOST_CHECK(!cache.get(key));
+    BOOST_CHECK_EQUAL(cache.size(), 0u);
+  }
+
+  // a broken file is an empty cache.
+  sys.write(file, "{ not json");
+  DeviceCache cache(file);
+  BOOST_CHECK_EQUAL(cache.size(), 0u);
+}
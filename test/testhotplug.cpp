@@ -0,0 +1,204 @@
+/*
+  testhotplug.cpp
+
+  Tests for finding devices with inotify. The devices are symlinks to
+  pseudo terminals in a directory of their own, made and removed the way
+  udev does it.
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#define BOOST_TEST_MODULE hotplug
+#include <boost/test/unit_test.hpp>
+
+#include "hotplug.hpp"
+#include "server.hpp"
+
+#include <nlohmann/json.hpp>
+#include <zmq.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/log/expressions.hpp>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+using namespace std;
+using njson = nlohmann::json;
+
+// away from a real server.
+static const int PULL_PORT = 25570;
+static const int PUSH_PORT = 25571;
+static const int REQ_PORT = 23024;
+
+// a directory of devices, removed with everything in it.
+struct DevDir {
+
+  DevDir() {
+    char d[] = "/tmp/zmqarduino_testhotplug.XXXXXX";
+    BOOST_REQUIRE(mkdtemp(d));
+    dir = d;
+    BOOST_REQUIRE(openpty(&master, &slave, name, 0, 0) == 0);
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+  }
+  ~DevDir() {
+    for (auto f : { "ttyUSB0", "pty0" }) {
+      unlink((dir + "/" + f).c_str());
+    }
+    rmdir(dir.c_str());
+    close(master);
+    close(slave);
+  }
+
+  string path(const string &f) { return dir + "/" + f; }
+
+  void link(const string &target, const string &f) {
+    BOOST_REQUIRE(symlink(target.c_str(), path(f).c_str()) == 0);
+  }
+  void remove(const string &f) {
+    BOOST_REQUIRE(unlink(path(f).c_str()) == 0);
+  }
+
+  // what udev does when it sets the permissions.
+  void touch(const string &f) {
+    BOOST_REQUIRE(lchown(path(f).c_str(), getuid(), getgid()) == 0);
+  }
+
+  string dir;
+  int master;
+  int slave;
+  char name[256];
+
+};
+
+#ifdef __linux__
+
+BOOST_AUTO_TEST_CASE( eventsInOrder )
+{
+  DevDir d;
+  Hotplug h(d.dir);
+  BOOST_REQUIRE(h.fd() >= 0);
+
+  d.link(d.name, "ttyUSB0");
+  d.touch("ttyUSB0");
+  d.remove("ttyUSB0");
+  d.link(d.name, "ttyUSB0");
+
+  vector<Hotplug::Event> events;
+  BOOST_CHECK(h.read(&events));
+  BOOST_REQUIRE_EQUAL(events.size(), 4u);
+  Hotplug::Change changes[] = { Hotplug::added, Hotplug::changed, Hotplug::removed, Hotplug::added };
+  for (int i=0; i<4; i++) {
+    BOOST_CHECK_EQUAL(events[i].change, changes[i]);
+    BOOST_CHECK_EQUAL(events[i].path, d.path("ttyUSB0"));
+  }
+}
+
+#endif
+
+// the server running on a directory of devices, with what it tells the client.
+struct Running {
+
+  Running(const string &dir): context(1), push(context, ZMQ_PUSH), pull(context, ZMQ_PULL) {
+
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+    push.bind("tcp://127.0.0.1:" + to_string(PULL_PORT));
+    pull.bind("tcp://127.0.0.1:" + to_string(PUSH_PORT));
+
+    options.devdir = dir;
+    options.hotplug = true;
+    options.latencylog = 0;
+    server = thread([this]() {
+      zmq::socket_t spull(context, ZMQ_PULL);
+      spull.connect("tcp://127.0.0.1:" + to_string(PULL_PORT));
+      zmq::socket_t spush(context, ZMQ_PUSH);
+      spush.connect("tcp://127.0.0.1:" + to_string(PUSH_PORT));
+      Server s(&spull, &spush, REQ_PORT, options);
+      running = &s;
+      s.start();
+    });
+
+    // it watches before it looks for devices, and there aren't any.
+    while (!running) {
+      this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+
+  }
+  ~Running() {
+    running.load()->stop();
+    server.join();
+  }
+
+  // until the client is told name is path, false if it never is.
+  bool waitfor(const string &name, const string &path, int ms = 3000) {
+    zmq::pollitem_t items[] = { { pull, 0, ZMQ_POLLIN, 0 } };
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+    while (chrono::steady_clock::now() < deadline) {
+      zmq::poll(items, 1, chrono::milliseconds(10));
+      zmq::message_t msg;
+#if CPPZMQ_VERSION == ZMQ_MAKE_VERSION(4, 3, 1)
+      while (pull.recv(&msg, ZMQ_DONTWAIT)) {
+#else
+      while (pull.recv(msg, zmq::recv_flags::dontwait)) {
+#endif
+        njson doc = njson::parse(string((const char *)msg.data(), msg.size()), nullptr, false);
+        if (doc.is_object() && doc.contains(name) && doc[name] == path) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  ServerOptions options;
+  zmq::context_t context;
+  zmq::socket_t push;
+  zmq::socket_t pull;
+  atomic<Server *> running { 0 };
+  thread server;
+
+};
+
+#ifdef __linux__
+
+BOOST_AUTO_TEST_CASE( connectDisconnect )
+{
+  DevDir d;
+  Running r(d.dir);
+  string dev = d.path("ttyUSB0");
+
+  // plugged in and out, twice.
+  for (int i=0; i<2; i++) {
+    d.link(d.name, "ttyUSB0");
+    BOOST_CHECK(r.waitfor("device", dev));
+    d.remove("ttyUSB0");
+    BOOST_CHECK(r.waitfor("removed", dev));
+  }
+
+  // one that can't be opened yet is tried again when its attributes change.
+  d.link(d.path("pty0"), "ttyUSB0");
+  BOOST_CHECK(!r.waitfor("device", dev, 500));
+  d.link(d.name, "pty0");
+  d.touch("ttyUSB0");
+  BOOST_CHECK(r.waitfor("device", dev));
+  d.remove("ttyUSB0");
+  BOOST_CHECK(r.waitfor("removed", dev));
+}
+
+#endif
@@ -0,0 +1,176 @@
+/*
+  testringbuffer.cpp
+
+  Tests for the receive buffer, with the data going round the end of it.
+
+  This work is licensed under the Creative Commons Attribution 4.0 International License.
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#define BOOST_TEST_MODULE ringbuffer
+#include <boost/test/unit_test.hpp>
+
+#include "RingBuffer.h"
+
+#include <string>
+
+using namespace std;
+
+// a buffer of 16 with the front at 10, so what goes in next wraps.
+static void wrapping(RingBuffer &buf) {
+  BOOST_REQUIRE_EQUAL(buf.append("0123456789", 10), 10u);
+  buf.consume(10);
+  BOOST_REQUIRE(buf.empty());
+}
+
+static void append(RingBuffer &buf, const string &s) {
+  BOOST_REQUIRE_EQUAL(buf.append(s.data(), s.size()), s.size());
+}
+
+BOOST_AUTO_TEST_CASE( capacity )
+{
+  BOOST_CHECK_EQUAL(RingBuffer(16).capacity(), 16u);
+  BOOST_CHECK_EQUAL(RingBuffer(17).capacity(), 32u);
+  BOOST_CHECK_EQUAL(RingBuffer(1000).capacity(), 1024u);
+}
+
+BOOST_AUTO_TEST_CASE( appendAcrossWrap )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  append(buf, "abcdefghij");
+  BOOST_CHECK_EQUAL(buf.size(), 10u);
+  BOOST_CHECK_EQUAL(buf.space(), 6u);
+  char data[16];
+  BOOST_CHECK_EQUAL(buf.read(data, sizeof(data)), 10u);
+  BOOST_CHECK_EQUAL(string(data, 10), "abcdefghij");
+  BOOST_CHECK(buf.empty());
+}
+
+BOOST_AUTO_TEST_CASE( appendWhenFull )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  // only what fits goes in.
+  BOOST_CHECK_EQUAL(buf.append("abcdefghijklmnopqrst", 20), 16u);
+  BOOST_CHECK(buf.full());
+  BOOST_CHECK_EQUAL(buf.space(), 0u);
+  BOOST_CHECK_EQUAL(buf.capacity(), 16u);
+  BOOST_CHECK_EQUAL(buf.append("u", 1), 0u);
+
+  // and there's room again once some is taken.
+  char data[4];
+  BOOST_CHECK_EQUAL(buf.read(data, 4), 4u);
+  BOOST_CHECK_EQUAL(string(data, 4), "abcd");
+  append(buf, "qrst");
+  BOOST_CHECK(buf.full());
+  char all[16];
+  BOOST_CHECK_EQUAL(buf.read(all, sizeof(all)), 16u);
+  BOOST_CHECK_EQUAL(string(all, 16), "efghijklmnopqrst");
+}
+
+BOOST_AUTO_TEST_CASE( findAcrossWrap )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  // the delimiter is split over the end.
+  append(buf, "abcde\r\nfg");
+  BOOST_CHECK_EQUAL(buf.find("\r\n"), 5u);
+  BOOST_CHECK_EQUAL(buf.find("\n"), 6u);
+  BOOST_CHECK_EQUAL(buf.find("x"), RingBuffer::npos);
+  BOOST_CHECK_EQUAL(buf.find(""), RingBuffer::npos);
+
+  // only half of it is there.
+  buf.clear();
+  wrapping(buf);
+  append(buf, "abcdef\r");
+  BOOST_CHECK_EQUAL(buf.find("\r\n"), RingBuffer::npos);
+  append(buf, "\n");
+  BOOST_CHECK_EQUAL(buf.find("\r\n"), 6u);
+}
+
+BOOST_AUTO_TEST_CASE( findCarriesOn )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  // a line arriving a bit at a time is found when its end arrives.
+  append(buf, "abc");
+  BOOST_CHECK_EQUAL(buf.find("\n"), RingBuffer::npos);
+  append(buf, "def");
+  BOOST_CHECK_EQUAL(buf.find("\n"), RingBuffer::npos);
+  append(buf, "g\nh");
+  BOOST_CHECK_EQUAL(buf.find("\n"), 7u);
+
+  // taking some off the front moves it along.
+  buf.consume(2);
+  BOOST_CHECK_EQUAL(buf.find("\n"), 5u);
+}
+
+BOOST_AUTO_TEST_CASE( findWhenFull )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  // right at the back of a full buffer.
+  append(buf, string(15, 'x') + "\n");
+  BOOST_CHECK(buf.full());
+  BOOST_CHECK_EQUAL(buf.find("\n"), 15u);
+
+  // and not there at all.
+  buf.clear();
+  append(buf, string(16, 'x'));
+  BOOST_CHECK_EQUAL(buf.find("\n"), RingBuffer::npos);
+}
+
+BOOST_AUTO_TEST_CASE( readUntilAcrossWrap )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  append(buf, "one\ntwo\r\nth");
+  string line = "unchanged";
+  BOOST_CHECK(buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(line, "one");
+  BOOST_CHECK(buf.readUntil("\r\n", line));
+  BOOST_CHECK_EQUAL(line, "two");
+
+  // the rest isn't a line yet.
+  BOOST_CHECK(!buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(line, "two");
+  append(buf, "ree\n");
+  BOOST_CHECK(buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(line, "three");
+  BOOST_CHECK(buf.empty());
+
+  // an empty line.
+  append(buf, "\n");
+  BOOST_CHECK(buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(line, "");
+}
+
+BOOST_AUTO_TEST_CASE( readUntilWhenFull )
+{
+  RingBuffer buf(16);
+  wrapping(buf);
+
+  // a line that fills it.
+  append(buf, string(15, 'y') + "\n");
+  BOOST_CHECK(buf.full());
+  string line;
+  BOOST_CHECK(buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(line, string(15, 'y'));
+  BOOST_CHECK(buf.empty());
+
+  // one too long for it never ends.
+  append(buf, string(16, 'z'));
+  BOOST_CHECK(!buf.readUntil("\n", line));
+  BOOST_CHECK_EQUAL(buf.append("\n", 1), 0u);
+  BOOST_CHECK(!buf.readUntil("\n", line));
+}
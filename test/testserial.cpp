@@ -0,0 +1,284 @@
+/*
+  testserial.cpp
+  
+  Tests for the serial buffering, on pseudo terminals so that no hardware 
+  is needed.
+  
+  This work is licensed under the Creative Commons Attribution 4.0 International License. 
+  To view a copy of this license, visit http://creativecommons.org/licenses/by/4.0/ or 
+  send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+  https://github.com/visualopsholdings/zmqarduino
+*/
+
+#define BOOST_TEST_MODULE serial
+#include <boost/test/unit_test.hpp>
+
+#include "BufferedAsyncSerial.h"
+
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+using namespace std;
+
+// a pseudo terminal that a BufferedAsyncSerial is opened on.
+struct Pty {
+
+  Pty(SerialIoPool *pool = 0) {
+    char name[256];
+    BOOST_REQUIRE(openpty(&master, &slave, name, 0, 0) == 0);
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    serial.reset(pool ? new BufferedAsyncSerial(pool) : new BufferedAsyncSerial());
+    path = name;
+  }
+  ~Pty() {
+    serial.reset();
+    close(master);
+    close(slave);
+  }
+  
+  void send(const string &s) {
+    BOOST_REQUIRE(write(master, s.data(), s.size()) == (ssize_t)s.size());
+  }
+  
+  // everything the device has been sent until it ends with s.
+  bool waitfor(const string &s) {
+    string got;
+    char buf[256];
+    for (int i=0; i<500; i++) {
+      ssize_t n = read(master, buf, sizeof(buf));
+      if (n > 0) {
+        got.append(buf, n);
+        if (got.size() >= s.size() && got.compare(got.size() - s.size(), s.size(), s) == 0) {
+          return true;
+        }
+      }
+      else {
+        this_thread::sleep_for(chrono::milliseconds(10));
+      }
+    }
+    return false;
+  }
+  
+  // read lines slowly, the way a busy server would.
+  int readlines(int count) {
+    int lines = 0;
+    string line;
+    for (int i=0; i<500 && lines < count; i++) {
+      if (serial->readLineUntil(line)) {
+        BOOST_CHECK_EQUAL(line, "line " + to_string(lines) + string(20, 'x'));
+        lines++;
+      }
+      else {
+        this_thread::sleep_for(chrono::milliseconds(10));
+      }
+    }
+    return lines;
+  }
+  
+  int master;
+  int slave;
+  string path;
+  unique_ptr<BufferedAsyncSerial> serial;
+  
+};
+
+static void pauseresume(SerialIoPool *pool) {
+
+  Pty pty(pool);
+  pty.serial->setReadLimit(256, 64);
+  pty.serial->open(pty.path, 9600);
+  
+  string lines;
+  for (int i=0; i<100; i++) {
+    lines += "line " + to_string(i) + string(20, 'x') + "\n";
+  }
+  pty.send(lines);
+  
+  // reading stops and starts again while they are read.
+  BOOST_CHECK_EQUAL(pty.readlines(100), 100);
+  BOOST_CHECK(pty.serial->overflows() > 0);
+  BOOST_CHECK(!pty.serial->readingPaused());
+  
+  // and writing still works.
+  pty.serial->writeString("done\n");
+  BOOST_CHECK(pty.waitfor("done\n"));
+  
+}
+
+BOOST_AUTO_TEST_CASE( pauseResumeThread )
+{
+  pauseresume(0);
+}
+
+BOOST_AUTO_TEST_CASE( pauseResumePool )
+{
+  SerialIoPool pool(2);
+  pauseresume(&pool);
+}
+
+BOOST_AUTO_TEST_CASE( unblockPartialLine )
+{
+  Pty pty;
+  pty.serial->setReadLimit(256, 64);
+  pty.serial->open(pty.path, 9600);
+  
+  // a line that's only partly there when reading stops.
+  string lines;
+  for (int i=0; i<8; i++) {
+    lines += "line " + to_string(i) + string(20, 'x') + "\n";
+  }
+  pty.send(lines + string(100, 'y'));
+  BOOST_CHECK_EQUAL(pty.readlines(8), 8);
+  BOOST_CHECK(pty.serial->readingPaused());
+  
+  // it's under the high mark, so it can be read to the end.
+  BOOST_CHECK(pty.serial->unblockReading());
+  pty.send("y\n");
+  string line;
+  for (int i=0; i<500 && !pty.serial->readLineUntil(line); i++) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(line, string(101, 'y'));
+}
+
+BOOST_AUTO_TEST_CASE( fullWithoutLine )
+{
+  Pty pty;
+  pty.serial->setReadLimit(256, 64);
+  pty.serial->open(pty.path, 9600);
+  
+  // a line longer than the high mark can never be read.
+  pty.send(string(300, 'z'));
+  for (int i=0; i<500 && !pty.serial->readingPaused(); i++) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  BOOST_CHECK(pty.serial->readingPaused());
+  BOOST_CHECK(!pty.serial->unblockReading());
+}
+
+BOOST_AUTO_TEST_CASE( xoffWithoutCredit )
+{
+  Pty pty;
+  pty.serial->setReadLimit(256, 64, BufferedAsyncSerial::software);
+  pty.serial->setCreditWindow(8);
+  pty.serial->open(pty.path, 9600);
+  
+  // the device hasn't acked, so only the first 8 go.
+  pty.serial->writeString(string(100, 'w'));
+  BOOST_CHECK(pty.waitfor(string(8, 'w')));
+  
+  // but it's still told to stop, and to start again.
+  pty.send(string(200, 'l') + "\n" + string(60, 'l'));
+  BOOST_CHECK(pty.waitfor("\x13"));
+  string line;
+  for (int i=0; i<500 && !pty.serial->readLineUntil(line); i++) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(line, string(200, 'l'));
+  BOOST_CHECK(pty.waitfor("\x11"));
+  
+  // and then the rest goes as it acks.
+  string got;
+  char buf[256];
+  for (int i=0; i<500 && got.size() < 92; i++) {
+    pty.serial->addCredit(8);
+    this_thread::sleep_for(chrono::milliseconds(5));
+    ssize_t n = read(pty.master, buf, sizeof(buf));
+    if (n > 0) {
+      got.append(buf, n);
+    }
+  }
+  BOOST_CHECK_EQUAL(got, string(92, 'w'));
+}
+
+BOOST_AUTO_TEST_CASE( priorityWithCredit )
+{
+  Pty pty;
+  pty.serial->setCreditWindow(8);
+  pty.serial->open(pty.path, 9600);
+  
+  // the first line has started when the urgent one is sent.
+  for (int i=0; i<3; i++) {
+    pty.serial->writeLine(string(30, 'a' + i));
+  }
+  BOOST_CHECK(pty.waitfor(string(8, 'a')));
+  pty.serial->writeLine("urgent", '\n', 1);
+  
+  // so it goes after that line, but before the others.
+  string got;
+  char buf[256];
+  for (int i=0; i<500 && got.size() < 92; i++) {
+    pty.serial->addCredit(8);
+    this_thread::sleep_for(chrono::milliseconds(5));
+    ssize_t n = read(pty.master, buf, sizeof(buf));
+    if (n > 0) {
+      got.append(buf, n);
+    }
+  }
+  BOOST_CHECK_EQUAL(got, string(22, 'a') + "\nurgent\n" + string(30, 'b') + "\n" + string(30, 'c') + "\n");
+}
+
+BOOST_AUTO_TEST_CASE( creditWindowChange )
+{
+  Pty pty;
+  pty.serial->setCreditWindow(8);
+  pty.serial->open(pty.path, 9600);
+  pty.serial->writeString(string(100, 'w'));
+  BOOST_CHECK(pty.waitfor(string(8, 'w')));
+  
+  // everything that has been sent.
+  auto sent = [&pty]() {
+    this_thread::sleep_for(chrono::milliseconds(200));
+    char buf[256];
+    ssize_t n = read(pty.master, buf, sizeof(buf));
+    return n > 0 ? n : 0;
+  };
+  
+  // the 8 not acked yet are still in the device's buffer.
+  pty.serial->setCreditWindow(12);
+  BOOST_CHECK_EQUAL(sent(), 4);
+  
+  // and so they are with a smaller window, until they are acked.
+  pty.serial->setCreditWindow(4);
+  BOOST_CHECK_EQUAL(sent(), 0);
+  pty.serial->addCredit(12);
+  BOOST_CHECK_EQUAL(sent(), 4);
+}
+
+BOOST_AUTO_TEST_CASE( priorityWhenFull )
+{
+  Pty pty;
+  pty.serial->setCreditWindow(1);
+  pty.serial->setWriteLimit(0, 2, false);
+  pty.serial->open(pty.path, 9600);
+  
+  // the first has started, waiting for credit, and the second waits behind it.
+  BOOST_CHECK(pty.serial->writeLine("first"));
+  BOOST_CHECK(pty.serial->writeLine("second"));
+  BOOST_CHECK(pty.waitfor("f"));
+  
+  // what was taken is kept, so the urgent one is refused.
+  BOOST_CHECK(!pty.serial->writeLine("urgent", '\n', 1));
+  BOOST_CHECK_EQUAL(pty.serial->writesDropped(), 0u);
+  
+  // unless the oldest can be dropped.
+  pty.serial->setWriteLimit(0, 2, true);
+  BOOST_CHECK(pty.serial->writeLine("urgent", '\n', 1));
+  BOOST_CHECK_EQUAL(pty.serial->writesDropped(), 1u);
+  pty.serial->setCreditWindow(0);
+  BOOST_CHECK(pty.waitfor("irst\nurgent\n"));
+}